@@ -0,0 +1,270 @@
+// Micro-benchmarks of the loader building blocks.
+//
+// Usage: torchdataxx_bench [filter] [--min-time=SECONDS]
+// Runs every benchmark whose name contains filter, and prints the time per
+// operation. All inputs are generated in a temporary directory.
+#include <torch/torch.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio.h"
+#include "augment.h"
+#include "dataset.h"
+#include "features.h"
+#include "sampler.h"
+#include "synthetic.h"
+#include "tensor_utils.h"
+#include "text/phonemizer.h"
+#include "text/utils.h"
+#include "types.h"
+
+namespace fs = std::filesystem;
+using namespace data;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Prevent the compiler from optimizing away a result.
+template <typename T> void keep(T const& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Benchmark {
+    std::string name;
+    // Run the operation n times.
+    std::function<void(size_t n)> run;
+};
+
+std::vector<Benchmark>& registry() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+void add(std::string name, std::function<void(size_t)> run) {
+    registry().push_back({std::move(name), std::move(run)});
+}
+
+// Double the iteration count until a run takes at least minTime.
+void measure(Benchmark const& b, double minTime) {
+    size_t n = 1;
+    double seconds = 0;
+    while (true) {
+        auto begin = Clock::now();
+        b.run(n);
+        seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        if (seconds >= minTime or n >= (size_t{1} << 30)) break;
+        n *= 2;
+    }
+    std::printf("%-44s %12.0f ns/op %10zu ops\n", b.name.c_str(),
+                seconds * 1e9 / n, n);
+    std::fflush(stdout);
+}
+
+// Synthetic items with a wave of nSample in [minLen, maxLen].
+ItemDict waveItems(size_t n, int64_t minLen, int64_t maxLen) {
+    SyntheticSpec spec;
+    spec.itemsPerShard = n;
+    spec.fields = {"wave"};
+    spec.minSamples = minLen;
+    spec.maxSamples = maxLen;
+    return syntheticItems(spec, 0);
+}
+
+// Samples the same item forever, isolates the cost of downstream stages.
+struct ConstantSampler final : Sampler {
+    Item item;
+    explicit ConstantSampler(Item item) : item{std::move(item)} {}
+    Item sample() override { return item; }
+};
+
+// Emulates an expensive upstream stage, e.g. decoding.
+struct BusySampler final : Sampler {
+    Item item;
+    std::chrono::microseconds work;
+    BusySampler(Item item, std::chrono::microseconds work)
+        : item{std::move(item)}, work{work} {}
+    Item sample() override {
+        auto end = Clock::now() + work;
+        while (Clock::now() < end) {
+        }
+        return item;
+    }
+};
+
+void registerCollation() {
+    add("TensorBuffer/push+pop/160", [](size_t n) {
+        TensorBuffer buffer(0);
+        auto chunk = torch::zeros({1600, 1}, torch::kInt32);
+        for (size_t i = 0; i < n; ++i) {
+            if (buffer.size() < 160) buffer.push(chunk);
+            keep(buffer.pop(160));
+        }
+    });
+    for (size_t batch : {8, 64}) {
+        add("stack_items/" + std::to_string(batch), [batch](size_t n) {
+            auto dict = waveItems(batch, 8000, 16000);
+            ItemList items;
+            for (auto& [k, v] : dict) items.push_back(v);
+            for (size_t i = 0; i < n; ++i) keep(stack_items(items));
+        });
+    }
+    add("bucket/4x16", [](size_t n) {
+        auto items = immediateDataset(waveItems(1024, 100, 4000));
+        Partition p{{0, 1000, 16}, {1000, 2000, 16}, {2000, 3000, 16},
+                    {3000, 4001, 16}};
+        auto s = bucketSampler(permuteSampleDataset(items), "nSample", p);
+        for (size_t i = 0; i < n; ++i) keep(s->sample());
+    });
+}
+
+void registerSamplers() {
+    add("permuteSample/immediate/4096", [](size_t n) {
+        auto s = permuteSampleDataset(
+            immediateDataset(waveItems(4096, 16, 16)));
+        for (size_t i = 0; i < n; ++i) keep(s->sample());
+    });
+    auto item = waveItems(1, 16000, 16000).begin()->second;
+    for (size_t threads : {1, 4, 16, 64}) {
+        add("queue/busy50us/" + std::to_string(threads),
+            [item, threads](size_t n) {
+                auto base = std::make_shared<BusySampler>(
+                    item, std::chrono::microseconds(50));
+                auto s = queueSampler(base, threads, 256);
+                for (size_t i = 0; i < n; ++i) keep(s->sample());
+            });
+        add("queue/constant/" + std::to_string(threads),
+            [item, threads](size_t n) {
+                auto base = std::make_shared<ConstantSampler>(item);
+                auto s = queueSampler(base, threads, 256);
+                for (size_t i = 0; i < n; ++i) keep(s->sample());
+            });
+    }
+    add("queueAdaptive/busy50us/1-64", [item](size_t n) {
+        auto base =
+            std::make_shared<BusySampler>(item, std::chrono::microseconds(50));
+        auto s = queueAdaptiveSampler(base, 1, 64, 256);
+        for (size_t i = 0; i < n; ++i) keep(s->sample());
+    });
+}
+
+void registerShards(fs::path const& dir) {
+    SyntheticSpec spec;
+    spec.itemsPerShard = 1024;
+    spec.minSamples = spec.maxSamples = 1600;
+    auto path = writeSyntheticCorpus((dir / "corpus").string(), spec, 0)[0];
+    add("loadShard/open/1024", [path](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(loadShard(path));
+    });
+    add("loadShard/getItem/1024", [path](size_t n) {
+        auto d = loadShard(path);
+        for (size_t i = 0; i < n; ++i) keep(d->getItem(i % d->size()));
+    });
+}
+
+void registerAudio(fs::path const& dir) {
+    auto path = (dir / "noise.wav").string();
+    auto items = waveItems(1, 16000 * 5, 16000 * 5);
+    auto wave = std::get<Tensor>(items.begin()->second.at("wave"));
+    wavSavePCM(wave, path, 16000, 16);
+    add("readAudio/wav16k/5s", [path](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(readAudio(path));
+    });
+    auto flac = encodeAudio(wave, 16000, "flac", 16);
+    add("decodeAudio/flac16k/5s", [flac](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(decodeAudio(flac));
+    });
+    add("probeAudio/wav16k/64", [path](size_t n) {
+        StringList paths(64, path);
+        for (size_t i = 0; i < n; ++i) keep(probeAudio(paths, 1));
+    });
+    add("readAudio/wav16k/5s/int16", [path](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            keep(readAudio(path, 0, SIZE_MAX, torch::kInt16));
+        }
+    });
+    add("pcmToFloat32/int32/5s", [wave](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(pcmToFloat32(wave));
+    });
+    auto f32 = pcmToFloat32(wave);
+    add("float32ToPCM/16bit+dither/5s", [f32](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(float32ToPCM(f32, 16, true));
+    });
+    auto mel = std::make_shared<MelSpectrogram>(MelSpec{});
+    add("melSpectrogram/16k/5s", [mel, f32](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep((*mel)(f32));
+    });
+    add("estimatePitch/16k/5s", [f32](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(estimatePitch(f32, PitchSpec{}));
+    });
+    auto rir = torch::randn({4800}) * torch::exp(-torch::arange(4800) / 800.);
+    auto rirs = std::make_shared<AudioBank>(std::vector<Tensor>{rir}, 16000);
+    auto reverb = reverbTransform("wave", "sr", rirs, 1.0);
+    add("reverb/16k/5s", [reverb, f32](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            keep((*reverb)(Item{{"wave", f32.clone()}, {"sr", 16000.0}}));
+        }
+    });
+    add("resample/16k->24k/5s", [wave](size_t n) {
+        for (size_t i = 0; i < n; ++i) keep(resample(wave, 16000, 24000));
+    });
+    add("resample/16k->24k/quick/5s", [wave](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            keep(resample(wave, 16000, 24000, ResampleQuality::Quick));
+        }
+    });
+}
+
+void registerText() {
+    std::string sentence =
+        "The quick brown fox jumps over the lazy dog, again and again.";
+    add("phonemize/sentence", [sentence](size_t n) {
+        auto& p = espeak_phonemizer::get_thread_phonemizer();
+        for (size_t i = 0; i < n; ++i) keep(p.phonemize(sentence));
+    });
+    add("encodeIPA/sentence", [sentence](size_t n) {
+        auto ipa =
+            espeak_phonemizer::get_thread_phonemizer().phonemize(sentence);
+        for (size_t i = 0; i < n; ++i) keep(encodeIPA(ipa));
+    });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string filter;
+    double minTime = 0.5;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.starts_with("--min-time=")) {
+            minTime = std::stod(arg.substr(11));
+        } else {
+            filter = arg;
+        }
+    }
+    // Benchmarks measure their own threading, keep torch single-threaded.
+    torch::set_num_threads(1);
+
+    auto dir = fs::temp_directory_path() /
+               ("torchdataxx_bench_" + std::to_string(getpid()));
+    fs::create_directories(dir);
+    registerCollation();
+    registerSamplers();
+    registerShards(dir);
+    registerAudio(dir);
+    registerText();
+
+    for (auto const& b : registry()) {
+        if (b.name.find(filter) != std::string::npos) measure(b, minTime);
+    }
+    fs::remove_all(dir);
+    return 0;
+}
@@ -9,9 +9,16 @@
 #include <memory>
 #include <string_view>
 
+#include "affinity.h"
 #include "audio.h"
+#include "augment.h"
 #include "dataset.h"
+#include "features.h"
 #include "functional.h"
+#include "profiler.h"
+#include "shm.h"
+#include "synthetic.h"
+#include "trace.h"
 #include "tensor_utils.h"
 #include "text/en_data.h"
 #include "text/phonemizer.h"
@@ -23,6 +30,33 @@ using namespace pybind11::literals;
 
 namespace data {
 
+// Convert a StatsReport into a nested dict.
+inline py::dict statsToDict(StatsReport const& r) {
+    py::dict d;
+    d["stage"] = r.stage;
+    for (auto const& [k, v] : r.values) d[py::str(k)] = v;
+    py::list inputs;
+    for (auto const& input : r.inputs) inputs.append(statsToDict(input));
+    d["inputs"] = inputs;
+    return d;
+}
+
+// Binding for csrc/profiler.h and csrc/trace.h
+inline void bindProfiler(py::module& m) {
+    m.def("setProfiling", setProfiling, py::arg("enabled"));
+    m.def("profilingEnabled", profilingEnabled);
+    m.def("startTrace", startTrace, py::arg("eventsPerThread") = 65536);
+    m.def("stopTrace", stopTrace);
+    m.def("dumpTrace", dumpTrace, py::arg("path"));
+}
+
+// Binding for csrc/affinity.h
+inline void bindAffinity(py::module& m) {
+    m.def("parseCpuList", parseCpuList, py::arg("list"));
+    m.def("numaNodeCpus", numaNodeCpus, py::arg("node"));
+    m.def("currentAffinity", currentAffinity);
+}
+
 // Binding for csrc/functional.h
 inline void bindFunctional(py::module& m) {
     auto F = m.def_submodule("functional", "Functionals");
@@ -48,29 +82,90 @@ inline void bindFunctional(py::module& m) {
     F.def("addTotalLength", addTotalLength);
     F.def("addTotalLengthWithRef", addTotalLengthWithRef);
     F.def("readFile", readFile, py::arg("pathKey"), py::arg("textKey"));
+    F.def("intRange", intRange, py::arg("key"), py::arg("lo"), py::arg("hi"));
+    F.def("intIn", intIn, py::arg("key"), py::arg("values"));
+    F.def("stringIn", stringIn, py::arg("key"), py::arg("values"));
+    F.def("stringPrefix", stringPrefix, py::arg("key"), py::arg("prefix"));
+    F.def("stringRegex", stringRegex, py::arg("key"), py::arg("pattern"));
+    F.def("keyPrefix", keyPrefix, py::arg("prefix"));
+    F.def("keyRegex", keyRegex, py::arg("pattern"));
+    F.def("keyIn", keyIn, py::arg("keys"));
     F.def("readAudioTransform", readAudioTransform, py::arg{"pathKey"},
-          py::arg("waveKey"), py::arg("srKey"), py::arg("asFloat32"));
+          py::arg("waveKey"), py::arg("srKey"), py::arg("asFloat32"),
+          py::arg("lazy") = false, py::arg("dtype") = "");
+    F.def("readAudioSegmentTransform", readAudioSegmentTransform,
+          py::arg("pathKey"), py::arg("waveKey"), py::arg("srKey"),
+          py::arg("segmentSize"), py::arg("asFloat32"),
+          py::arg("offsetKey") = "", py::arg("dtype") = "");
+    F.def("resampleTransform", resampleTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("outRate"),
+          py::arg("quality") = ResampleQuality::Default);
+    F.def("decodeAudioTransform", decodeAudioTransform, py::arg("bytesKey"),
+          py::arg("waveKey"), py::arg("srKey"), py::arg("dtype") = "int32");
+    F.def("encodeAudioTransform", encodeAudioTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("bytesKey"), py::arg("format") = "flac",
+          py::arg("bits") = 16);
+    F.def("materialize", [](Item item) { return materialize(std::move(item)); },
+          py::arg("item"));
     F.def("audioPCM16AsFloat32", audioPCM16AsFloat32, py::arg("waveKey"));
 }
 
 // Binding for csrc/dataset.h
+// Items returned to Python are materialized, LazyValue is bound for items
+// passed through ItemTransform.__call__ and toMap().
 inline void bindDataset(py::module& m) {
+    auto mLazyValue = py::class_<LazyValue, LazyValueHandle>(m, "LazyValue")
+                          .def("get", &LazyValue::get);
     auto mDataset =
         py::class_<Dataset, DatasetHandle>(m, "Dataset")
             .def("__len__", &Dataset::size)
             .def("__contains__", &Dataset::contains, py::arg("key"))
-            .def("__getitem__", &Dataset::operator[], py::arg("key"))
-            .def("getItem", &Dataset::getItem, py::arg("idx"))
-            .def_readonly("keys", &Dataset::keys)
+            .def(
+                "__getitem__",
+                [](Dataset& d, std::string_view key) {
+                    return materialize(d[key]);
+                },
+                py::arg("key"))
+            .def(
+                "getItem",
+                [](Dataset& d, size_t idx) {
+                    return materialize(d.getItem(idx));
+                },
+                py::arg("idx"))
+            .def_property_readonly("keys", &Dataset::keyList)
             .def("map", &Dataset::map, py::arg("func"))
             .def("filter", &Dataset::filter, py::arg("pred"))
+            .def("select", &Dataset::select, py::arg("pred"),
+                 py::call_guard<py::gil_scoped_release>())
+            .def("where", &Dataset::where, py::arg("pred"),
+                 py::call_guard<py::gil_scoped_release>())
             .def("zip", &Dataset::zip, py::arg("other"))
             .def("merge", &Dataset::merge, py::arg("other"))
             .def("prefix", &Dataset::prefix, py::arg("prefix"))
             .def("sample", &Dataset::sample)
             .def("permuteSample", &Dataset::permuteSample)
-            .def("toMap", &Dataset::toMap);
+            .def("distributedPermuteSample", &Dataset::distributedPermuteSample,
+                 py::arg("rank"), py::arg("worldSize"), py::arg("seed"),
+                 py::arg("weightKey") = "")
+            .def("iterate", &Dataset::iterate, py::arg("nThreads"),
+                 py::arg("ordered"), py::arg("shardAware"))
+            .def("toMap", &Dataset::toMap)
+            .def("stats", [](Dataset& d) { return statsToDict(d.stats()); });
+    py::class_<DatasetIterator, DatasetIteratorHandle>(m, "DatasetIterator")
+        .def("__iter__", [](DatasetIteratorHandle it) { return it; })
+        .def("__next__",
+             [](DatasetIterator& it) {
+                 std::optional<Item> item;
+                 {
+                     py::gil_scoped_release release;
+                     item = it.next();
+                 }
+                 if (not item) throw py::stop_iteration();
+                 return std::move(*item);
+             })
+        .def("__len__", &DatasetIterator::size);
     m.def("loadShard", loadShard, py::arg("path"));
+    m.def("saveShard", saveShard, py::arg("items"), py::arg("path"));
     m.def("immediateDataset", immediateDataset, py::arg("items"));
 }
 
@@ -78,11 +173,21 @@ inline void bindDataset(py::module& m) {
 inline void bindSampler(py::module& m) {
     auto mSampler =
         py::class_<Sampler, SamplerHandle>(m, "Sampler")
-            .def("sample", &Sampler::sample)
+            .def("sample", [](Sampler& s) { return materialize(s.sample()); })
             .def("map", &Sampler::map, py::arg("func"))
-            .def("filter", &Sampler::filter, py::arg("pred"))
+            .def("mapOrdered", &Sampler::mapOrdered, py::arg("func"),
+                 py::arg("nThreads"), py::arg("window"))
+            .def("filter", &Sampler::filter, py::arg("pred"),
+                 py::arg("pushdown") = false,
+                 py::call_guard<py::gil_scoped_release>())
             .def("queue", &Sampler::queue, py::arg("nThreads"),
-                 py::arg("queueSize"))
+                 py::arg("queueSize"), py::arg("cpus") = CpuSet{},
+                 py::arg("maxRetries") = 64)
+            .def("queueAdaptive", &Sampler::queueAdaptive,
+                 py::arg("minThreads"), py::arg("maxThreads"),
+                 py::arg("queueSize"), py::arg("cpus") = CpuSet{},
+                 py::arg("maxRetries") = 64)
+            .def("cancel", &Sampler::cancel)
             .def("batch", &Sampler::batch, py::arg("batchSize"))
             .def("zipDataset", &Sampler::zipDataset, py::arg("dataset"),
                  py::arg("keyKey"))
@@ -96,28 +201,162 @@ inline void bindSampler(py::module& m) {
             .def("bucket", &Sampler::bucket, py::arg("sortKey"),
                  py::arg("partition"))
             .def("sampleShard", &Sampler::sampleShard, py::arg("shardPathKey"),
-                 py::arg("shardIDKey"), py::arg("samplesPerShard"))
+                 py::arg("shardIDKey"), py::arg("samplesPerShard"),
+                 py::arg("rank") = 0, py::arg("worldSize") = 1,
+                 py::arg("seed") = 0)
             .def("sampleZipShard", &Sampler::sampleZipShard,
                  py::arg("shardPathKeys"), py::arg("shardIDKey"),
-                 py::arg("samplesPerShard"))
+                 py::arg("samplesPerShard"), py::arg("rank") = 0,
+                 py::arg("worldSize") = 1, py::arg("seed") = 0)
             .def("rotaryCache", &Sampler::rotaryCache, py::arg("cacheSuffix"),
-                 py::arg("classKey"), py::arg("keyKey"));
+                 py::arg("classKey"), py::arg("keyKey"))
+            .def("stats", [](Sampler& s) { return statsToDict(s.stats()); });
 
     auto mBatchSampler =
         py::class_<BatchSampler, BatchSamplerHandle>(m, "BatchSampler")
-            .def("sample", &BatchSampler::sample)
+            .def("sample",
+                 [](BatchSampler& s) {
+                     auto items = s.sample();
+                     for (auto& item : items) {
+                         item = materialize(std::move(item));
+                     }
+                     return items;
+                 })
             .def("stack", &BatchSampler::stack)
-            .def("flatten", &BatchSampler::flatten);
+            .def("flatten", &BatchSampler::flatten)
+            .def("cancel", &BatchSampler::cancel)
+            .def("stats",
+                 [](BatchSampler& s) { return statsToDict(s.stats()); });
 }
 
 // Binding for csrc/audio.h
 inline void bindAudio(py::module& m) {
     auto A = m.def_submodule("audio", "Audio Utilities.");
-    A.def("readAudio", readAudio, py::arg("path"));
+    A.def(
+        "readAudio",
+        [](std::string_view path, size_t offset, size_t n,
+           std::string_view dtype) {
+            return readAudio(path, offset, n, audioDtype(dtype));
+        },
+        py::arg("path"), py::arg("offset") = 0, py::arg("n") = SIZE_MAX,
+        py::arg("dtype") = "int32", py::call_guard<py::gil_scoped_release>());
+    py::enum_<ResampleQuality>(A, "ResampleQuality")
+        .value("Default", ResampleQuality::Default)
+        .value("Quick", ResampleQuality::Quick)
+        .value("Low", ResampleQuality::Low)
+        .value("Medium", ResampleQuality::Medium)
+        .value("High", ResampleQuality::High)
+        .value("VeryHigh", ResampleQuality::VeryHigh);
+    A.def(
+        "decodeAudio",
+        [](Tensor bytes, std::string_view dtype) {
+            return decodeAudio(bytes, audioDtype(dtype));
+        },
+        py::arg("bytes"), py::arg("dtype") = "int32",
+        py::call_guard<py::gil_scoped_release>());
+    A.def("encodeAudio", encodeAudio, py::arg("wave"), py::arg("rate"),
+          py::arg("format"), py::arg("bits") = 16,
+          py::call_guard<py::gil_scoped_release>());
+    A.def("probeAudio", probeAudio, py::arg("paths"), py::arg("nThreads") = 0,
+          py::call_guard<py::gil_scoped_release>());
     A.def("resample", resample, py::arg("inWave"), py::arg("inRate"),
-          py::arg("outRate"));
+          py::arg("outRate"), py::arg("quality") = ResampleQuality::Default,
+          py::call_guard<py::gil_scoped_release>());
+    py::class_<Resampler>(A, "Resampler")
+        .def(py::init([](double inRate, double outRate, unsigned channels,
+                         std::string_view dtype, ResampleQuality quality) {
+                 return Resampler(inRate, outRate, channels,
+                                  audioDtype(dtype), quality);
+             }),
+             py::arg("inRate"), py::arg("outRate"), py::arg("channels"),
+             py::arg("dtype") = "float32",
+             py::arg("quality") = ResampleQuality::Default)
+        .def("process", &Resampler::process, py::arg("chunk"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("flush", &Resampler::flush,
+             py::call_guard<py::gil_scoped_release>())
+        .def("reset", &Resampler::reset);
     A.def("wavSavePCM", wavSavePCM, py::arg("wave"), py::arg("path"),
-          py::arg("sr"), py::arg("bits"));
+          py::arg("sr"), py::arg("bits"), py::arg("dither") = false);
+    A.def("pcmToFloat32", pcmToFloat32, py::arg("wave"));
+    A.def("float32ToPCM", float32ToPCM, py::arg("wave"), py::arg("bits"),
+          py::arg("dither") = false);
+}
+
+// Binding for csrc/features.h
+inline void bindFeatures(py::module& m) {
+    auto A = py::reinterpret_borrow<py::module>(m.attr("audio"));
+    py::class_<MelSpec>(A, "MelSpec")
+        .def(py::init<>())
+        .def_readwrite("sampleRate", &MelSpec::sampleRate)
+        .def_readwrite("nFft", &MelSpec::nFft)
+        .def_readwrite("winLength", &MelSpec::winLength)
+        .def_readwrite("hopLength", &MelSpec::hopLength)
+        .def_readwrite("nMels", &MelSpec::nMels)
+        .def_readwrite("fMin", &MelSpec::fMin)
+        .def_readwrite("fMax", &MelSpec::fMax)
+        .def_readwrite("power", &MelSpec::power)
+        .def_readwrite("melScale", &MelSpec::melScale)
+        .def_readwrite("norm", &MelSpec::norm)
+        .def_readwrite("logEps", &MelSpec::logEps);
+    A.def(
+        "melSpectrogram",
+        [](Tensor wave, MelSpec spec) {
+            return MelSpectrogram(std::move(spec))(wave);
+        },
+        py::arg("wave"), py::arg("spec"),
+        py::call_guard<py::gil_scoped_release>());
+    py::class_<PitchSpec>(A, "PitchSpec")
+        .def(py::init<>())
+        .def_readwrite("sampleRate", &PitchSpec::sampleRate)
+        .def_readwrite("frameLength", &PitchSpec::frameLength)
+        .def_readwrite("hopLength", &PitchSpec::hopLength)
+        .def_readwrite("fMin", &PitchSpec::fMin)
+        .def_readwrite("fMax", &PitchSpec::fMax)
+        .def_readwrite("threshold", &PitchSpec::threshold);
+    A.def("estimatePitch", estimatePitch, py::arg("wave"), py::arg("spec"),
+          py::call_guard<py::gil_scoped_release>());
+    py::class_<EnergySpec>(A, "EnergySpec")
+        .def(py::init<>())
+        .def_readwrite("frameLength", &EnergySpec::frameLength)
+        .def_readwrite("hopLength", &EnergySpec::hopLength)
+        .def_readwrite("logEps", &EnergySpec::logEps);
+    A.def("frameEnergy", frameEnergy, py::arg("wave"), py::arg("spec"),
+          py::call_guard<py::gil_scoped_release>());
+    auto F = py::reinterpret_borrow<py::module>(m.attr("functional"));
+    F.def("melSpectrogramTransform", melSpectrogramTransform,
+          py::arg("waveKey"), py::arg("srKey"), py::arg("melKey"),
+          py::arg("nFrameKey"), py::arg("spec"));
+    F.def("pitchTransform", pitchTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("f0Key"), py::arg("spec"));
+    F.def("energyTransform", energyTransform, py::arg("waveKey"),
+          py::arg("energyKey"), py::arg("spec"));
+}
+
+// Binding for csrc/augment.h
+inline void bindAugment(py::module& m) {
+    auto A = py::reinterpret_borrow<py::module>(m.attr("audio"));
+    py::class_<AudioBank, AudioBankHandle>(A, "AudioBank")
+        .def(py::init<std::vector<Tensor> const&, double>(), py::arg("clips"),
+             py::arg("sampleRate"))
+        .def_static("load", &AudioBank::load, py::arg("paths"),
+                    py::arg("sampleRate"), py::arg("nThreads") = 0,
+                    py::call_guard<py::gil_scoped_release>())
+        .def("__len__", &AudioBank::size)
+        .def("sampleRate", &AudioBank::sampleRate)
+        .def("clip", &AudioBank::clip, py::arg("i"));
+    auto F = py::reinterpret_borrow<py::module>(m.attr("functional"));
+    F.def("addNoiseTransform", addNoiseTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("noises"), py::arg("snrMin"),
+          py::arg("snrMax"), py::arg("probability") = 1.0);
+    F.def("reverbTransform", reverbTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("rirs"), py::arg("probability") = 1.0);
+    F.def("gainTransform", gainTransform, py::arg("waveKey"),
+          py::arg("minDb"), py::arg("maxDb"), py::arg("probability") = 1.0);
+    F.def("speedTransform", speedTransform, py::arg("waveKey"),
+          py::arg("srKey"), py::arg("factors"),
+          py::arg("quality") = ResampleQuality::Default,
+          py::arg("probability") = 1.0);
 }
 
 // Binding for csrc//tensor_buffer.h
@@ -148,14 +387,62 @@ inline void bindText(py::module& m) {
     T.def("encodeIPATransform", &encodeIPATransform, py::arg("IPAKey"),
           py::arg("phoneIDKey"), py::arg("extraKey"), py::arg("nPhoneKey"));
 }
+
+// Binding for csrc/synthetic.h
+inline void bindSynthetic(py::module& m) {
+    auto S = m.def_submodule("synthetic", "Synthetic Corpora.");
+    py::class_<SyntheticSpec>(S, "SyntheticSpec")
+        .def(py::init<>())
+        .def_readwrite("nShards", &SyntheticSpec::nShards)
+        .def_readwrite("itemsPerShard", &SyntheticSpec::itemsPerShard)
+        .def_readwrite("fields", &SyntheticSpec::fields)
+        .def_readwrite("minSamples", &SyntheticSpec::minSamples)
+        .def_readwrite("maxSamples", &SyntheticSpec::maxSamples)
+        .def_readwrite("minPhones", &SyntheticSpec::minPhones)
+        .def_readwrite("maxPhones", &SyntheticSpec::maxPhones)
+        .def_readwrite("nSpeakers", &SyntheticSpec::nSpeakers)
+        .def_readwrite("waveDtype", &SyntheticSpec::waveDtype)
+        .def_readwrite("waveFormat", &SyntheticSpec::waveFormat)
+        .def_readwrite("sampleRate", &SyntheticSpec::sampleRate)
+        .def_readwrite("wavFiles", &SyntheticSpec::wavFiles)
+        .def_readwrite("seed", &SyntheticSpec::seed);
+    S.def("syntheticItems", syntheticItems, py::arg("spec"), py::arg("shard"),
+          py::call_guard<py::gil_scoped_release>());
+    S.def("writeSyntheticCorpus", writeSyntheticCorpus, py::arg("dir"),
+          py::arg("spec"), py::arg("nThreads") = 0,
+          py::call_guard<py::gil_scoped_release>());
+}
+
+inline void bindShm(py::module& m) {
+    py::class_<ShmRing, ShmRingHandle>(m, "ShmRing")
+        .def_static("create", &ShmRing::create, py::arg("name"),
+                    py::arg("nSlots"), py::arg("slotBytes"))
+        .def_static("open", &ShmRing::open, py::arg("name"))
+        .def("push", &ShmRing::push, py::arg("item"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("pop", &ShmRing::pop, py::call_guard<py::gil_scoped_release>())
+        .def("pump", &ShmRing::pump, py::arg("sampler"),
+             py::arg("count") = 0, py::call_guard<py::gil_scoped_release>())
+        .def("close", &ShmRing::close)
+        .def_property_readonly("closed", &ShmRing::closed)
+        .def_property_readonly("slots", &ShmRing::slots)
+        .def_property_readonly("slotBytes", &ShmRing::slotBytes);
+    m.def("shmRingSampler", shmRingSampler, py::arg("ring"));
+}
 }  // namespace data
 
 PYBIND11_MODULE(torchdataxx_C, m) {
     m.doc() = "TorchData-XX Python Binding Module";
+    data::bindProfiler(m);
+    data::bindAffinity(m);
     data::bindFunctional(m);
     data::bindDataset(m);
     data::bindSampler(m);
     data::bindAudio(m);
+    data::bindFeatures(m);
+    data::bindAugment(m);
     data::bindTensorBuffer(m);
     data::bindText(m);
+    data::bindSynthetic(m);
+    data::bindShm(m);
 }
@@ -0,0 +1,86 @@
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace data {
+
+namespace {
+int parseInt(std::string_view s) {
+    int v = 0;
+    auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+    if (ec != std::errc{} or p != s.data() + s.size() or v < 0) {
+        throw std::runtime_error("Invalid CPU ID: " + std::string(s));
+    }
+    return v;
+}
+}  // namespace
+
+CpuSet parseCpuList(std::string_view list) {
+    CpuSet cpus;
+    while (not list.empty()) {
+        auto comma = list.find(',');
+        auto range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? "" : list.substr(comma + 1);
+        while (not range.empty() and std::isspace(range.front())) {
+            range.remove_prefix(1);
+        }
+        while (not range.empty() and std::isspace(range.back())) {
+            range.remove_suffix(1);
+        }
+        if (range.empty()) continue;
+        auto dash = range.find('-');
+        if (dash == std::string_view::npos) {
+            cpus.push_back(parseInt(range));
+            continue;
+        }
+        int lo = parseInt(range.substr(0, dash));
+        int hi = parseInt(range.substr(dash + 1));
+        for (int i = lo; i <= hi; ++i) cpus.push_back(i);
+    }
+    return cpus;
+}
+
+CpuSet numaNodeCpus(int node) {
+    auto path =
+        "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    std::ifstream f(path);
+    if (!f) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return parseCpuList(ss.str());
+}
+
+CpuSet currentAffinity() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        throw std::runtime_error("Could not get the thread affinity.");
+    }
+    CpuSet cpus;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set)) cpus.push_back(i);
+    }
+    return cpus;
+}
+
+bool pinCurrentThread(CpuSet const& cpus) {
+    if (cpus.empty()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < 0 or cpu >= CPU_SETSIZE) return false;
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+}  // namespace data
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+CPU affinity for loader threads. On multi-socket nodes, pinning the workers
+to the NUMA node of the consumer keeps the memory they allocate on that node
+(first-touch), and avoids cross-socket traffic when the trainer reads it.
+*/
+
+namespace data {
+
+// A set of CPU IDs, empty for no constraint.
+using CpuSet = std::vector<int>;
+
+// Parse a Linux cpulist, e.g. "0-3,8,10-11".
+CpuSet parseCpuList(std::string_view list);
+
+// CPUs of a NUMA node, from /sys/devices/system/node/node<N>/cpulist.
+CpuSet numaNodeCpus(int node);
+
+// CPUs the calling thread may run on.
+CpuSet currentAffinity();
+
+// Restrict the calling thread to cpus. Returns false if the CPUs are not
+// available, leaving the affinity unchanged. An empty set is a no-op.
+bool pinCurrentThread(CpuSet const& cpus);
+
+}  // namespace data
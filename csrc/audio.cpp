@@ -1,100 +1,315 @@
 #include "audio.h"
 
 #include <sox.h>
-#include <soxr.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
 #include <torch/types.h>
 
-#include <climits>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <random>
 #include <stdexcept>
 #include <string_view>
+#include <vector>
 
+#include "pcm.h"
 #include "types.h"
+#include "wav.h"
 
 namespace data {
 
 std::once_flag once_format_init{};
 
-AudioFile::AudioFile(std::string_view path) : path{path} {
+namespace {
+void initSox() {
     std::call_once(once_format_init, [] { sox_format_init(); });
+}
+
+torch::ScalarType nativeDtype(unsigned bits, bool isFloat) {
+    if (isFloat) return torch::kFloat32;
+    return bits > 0 and bits <= 16 ? torch::kInt16 : torch::kInt32;
+}
+
+// Resolve kNativeDtype from the header of a file.
+torch::ScalarType fileDtype(torch::ScalarType dtype, WavFile const& wav) {
+    if (dtype != kNativeDtype) return dtype;
+    return nativeDtype(wav.bits, wav.isFloat);
+}
+
+// Lossy formats have no bits per sample, their precision is used instead.
+torch::ScalarType fileDtype(torch::ScalarType dtype, AudioFile const& file) {
+    if (dtype != kNativeDtype) return dtype;
+    auto bits = file.pt->encoding.bits_per_sample;
+    if (bits == 0) bits = file.pt->signal.precision;
+    return nativeDtype(bits, file.pt->encoding.encoding == SOX_ENCODING_FLOAT);
+}
+}  // namespace
+
+// sox counts the length in samples of all channels.
+void AudioFile::readSignal() {
+    rate = pt->signal.rate;
+    channels = pt->signal.channels;
+    length = pt->signal.length;
+    if (channels > 0 and length != SOX_UNKNOWN_LEN) length /= channels;
+}
+
+AudioFile::AudioFile(std::string_view path) : path{path} {
+    initSox();
     pt = sox_open_read(path.data(), nullptr, nullptr, nullptr);
     if (pt == nullptr) {
         throw std::runtime_error("failed to open file at path: " + this->path);
     }
-    length = pt->signal.length;
-    rate = pt->signal.rate;
-    channels = pt->signal.channels;
+    readSignal();
 }
 
 AudioMemoryFile::AudioMemoryFile(void* data, size_t size) {
-    std::call_once(once_format_init, [] { sox_format_init(); });
+    initSox();
     pt = sox_open_mem_read(data, size, nullptr, nullptr, nullptr);
     if (pt == nullptr) {
         throw std::runtime_error("failed to open memory file");
     }
-    length = pt->signal.length;
-    rate = pt->signal.rate;
-    channels = pt->signal.channels;
+    readSignal();
+}
+
+// Position the reader at frame offset. Formats without seeking decode and
+// drop the frames before it.
+void AudioFile::skip(size_t offset) const {
+    auto samples = offset * channels;
+    if (pt->seekable and sox_seek(pt, samples, SOX_SEEK_SET) == SOX_SUCCESS) {
+        return;
+    }
+    std::vector<sox_sample_t> scratch(8192);
+    while (samples > 0) {
+        auto n =
+            sox_read(pt, scratch.data(), std::min(samples, scratch.size()));
+        if (n == 0) break;
+        samples -= n;
+    }
+}
+
+// Files without a length in their header are decoded chunk by chunk, up to
+// n frames or the end of the stream.
+Tensor AudioFile::readStream(size_t offset, size_t n) const {
+    if (channels == 0) {
+        throw std::runtime_error("no channels in file at path: " + path);
+    }
+    if (offset > 0) skip(offset);
+    auto want = n > SIZE_MAX / channels ? SIZE_MAX : n * channels;
+    std::vector<sox_sample_t> samples;
+    size_t pos = 0;
+    while (pos < want) {
+        samples.resize(pos + std::min<size_t>(want - pos, 1 << 16));
+        auto cnt = sox_read(pt, samples.data() + pos, samples.size() - pos);
+        if (cnt == 0) break;
+        pos += cnt;
+    }
+    auto frames = static_cast<int64_t>(pos / channels);
+    auto wave =
+        torch::empty({frames, static_cast<int64_t>(channels)}, torch::kInt32);
+    std::memcpy(wave.data_ptr<int32_t>(), samples.data(),
+                frames * channels * sizeof(sox_sample_t));
+    return wave;
 }
 
 // For multi-channels audio, sox_read will return the channels interleaved.
 // wave (IntTensor): [length, channels].
-Tensor AudioFile::wave() const {
+Tensor AudioFile::wave(size_t offset, size_t n) const {
+    if (length == SOX_UNKNOWN_LEN) return readStream(offset, n);
+    offset = std::min(offset, length);
+    n = std::min(n, length - offset);
     Tensor wave = torch::empty(
-        {static_cast<int>(length), static_cast<int>(channels)}, torch::kInt32);
-    auto cnt = sox_read(pt, wave.data_ptr<int32_t>(), length * channels);
+        {static_cast<int64_t>(n), static_cast<int64_t>(channels)},
+        torch::kInt32);
+    if (offset > 0) skip(offset);
+    auto cnt = sox_read(pt, wave.data_ptr<int32_t>(), n * channels);
 
-    if (cnt == 0) {
+    if (n > 0 and cnt == 0) {
         throw std::runtime_error("failed to read file at path: " + this->path);
     }
-
+    if (cnt < n * channels) {
+        wave = wave.narrow(0, 0, static_cast<int64_t>(cnt / channels));
+    }
     return wave;
 }
 
 AudioFile::~AudioFile() noexcept { auto result = sox_close(pt); }
 
-// There are a lot of specifications here, you may want to tune them.
-// Typically precision = 16, the higher the better.
-Tensor resample(Tensor inWave, double inRate, double outRate) {
-    unsigned channels = inWave.size(1);
-    size_t in_length = inWave.size(0);
-    size_t out_length = static_cast<size_t>(in_length * outRate / inRate + .5);
-    Tensor out_wave =
-        torch::empty({static_cast<int>(out_length), channels}, torch::kInt32);
+std::pair<Tensor, double> readAudio(std::string_view path, size_t offset,
+                                    size_t n, torch::ScalarType dtype) {
+    if (auto wav = WavFile::open(std::string(path))) {
+        return {wav->wave(offset, n, fileDtype(dtype, *wav)), wav->rate};
+    }
+    auto file = AudioFile(path);
+    auto wave = file.wave(offset, n);
+    return {pcm32AsDtype(wave, fileDtype(dtype, file)), file.rate};
+}
 
-    soxr_io_spec_t const io_spec{
-        .itype = SOXR_INT32_I, .otype = SOXR_INT32_I, .scale = 1.0};
+std::pair<Tensor, double> readAudioMemory(void* data, size_t size,
+                                          torch::ScalarType dtype) {
+    auto file = AudioMemoryFile(data, size);
+    auto wave = file.wave();
+    return {pcm32AsDtype(wave, fileDtype(dtype, file)), file.rate};
+}
 
-    soxr_quality_spec_t const quality_spec{.precision = 20,
-                                           .phase_response = 50,
-                                           .passband_end = 0.95,
-                                           .stopband_begin = 1.0};
+std::pair<Tensor, double> decodeAudio(Tensor bytes, torch::ScalarType dtype) {
+    bytes = bytes.contiguous();
+    return readAudioMemory(bytes.data_ptr(), bytes.nbytes(), dtype);
+}
 
-    soxr_oneshot(inRate, outRate, channels, inWave.data_ptr<int32_t>(),
-                 in_length, nullptr, out_wave.data_ptr<int32_t>(), out_length,
-                 nullptr, &io_spec, &quality_spec, nullptr);
-    return out_wave;
+Tensor encodeAudio(Tensor wave, double rate, std::string const& format,
+                   unsigned bits) {
+    initSox();
+    if (wave.is_floating_point()) {
+        wave = float32ToPCM(wave, bits, false);
+    } else if (wave.scalar_type() == torch::kInt16) {
+        wave = wave.to(torch::kInt32) * 65536;
+    }
+    wave = wave.contiguous();
+    unsigned channels = wave.size(1);
+    size_t length = wave.size(0);
+    sox_signalinfo_t signal{.rate = rate,
+                            .channels = channels,
+                            .precision = bits,
+                            .length = length * channels};
+    char* buffer = nullptr;
+    size_t size = 0;
+    auto pt = sox_open_memstream_write(&buffer, &size, &signal, nullptr,
+                                       format.c_str(), nullptr);
+    if (pt == nullptr) {
+        throw std::runtime_error("failed to encode audio as " + format);
+    }
+    size_t cnt = sox_write(pt, wave.data_ptr<int32_t>(), length * channels);
+    sox_close(pt);
+    std::unique_ptr<char, decltype(&free)> owned(buffer, &free);
+    if (cnt != length * channels) {
+        throw std::runtime_error("failed to encode audio as " + format);
+    }
+    auto bytes = torch::empty({static_cast<int64_t>(size)}, torch::kUInt8);
+    std::memcpy(bytes.data_ptr(), buffer, size);
+    return bytes;
 }
 
-std::pair<Tensor, double> readAudio(std::string_view path) {
-    auto file = AudioFile(path);
-    auto wave = file.wave();
-    return {wave, file.rate};
+Item probeAudio(StringList const& paths, size_t nThreads) {
+    auto n = static_cast<int64_t>(paths.size());
+    auto rate = torch::zeros({n}, torch::kFloat64);
+    auto channels = torch::zeros({n}, torch::kInt32);
+    auto bits = torch::zeros({n}, torch::kInt32);
+    auto length = torch::zeros({n}, torch::kInt64);
+    auto encoding = torch::zeros({n}, torch::kInt32);
+    auto ok = torch::zeros({n}, torch::kBool);
+    auto pRate = rate.data_ptr<double>();
+    auto pChannels = channels.data_ptr<int32_t>();
+    auto pBits = bits.data_ptr<int32_t>();
+    auto pLength = length.data_ptr<int64_t>();
+    auto pEncoding = encoding.data_ptr<int32_t>();
+    auto pOk = ok.data_ptr<bool>();
+
+    auto probe = [&](size_t i) {
+        if (auto wav = WavFile::open(paths[i])) {
+            pRate[i] = wav->rate;
+            pChannels[i] = static_cast<int32_t>(wav->channels);
+            pBits[i] = static_cast<int32_t>(wav->bits);
+            pLength[i] = static_cast<int64_t>(wav->length);
+            pEncoding[i] = wav->isFloat      ? SOX_ENCODING_FLOAT
+                           : wav->bits == 8 ? SOX_ENCODING_UNSIGNED
+                                            : SOX_ENCODING_SIGN2;
+            pOk[i] = true;
+            return;
+        }
+        // sox_open_read parses the header only.
+        try {
+            auto file = AudioFile(paths[i]);
+            pRate[i] = file.rate;
+            pChannels[i] = static_cast<int32_t>(file.channels);
+            pBits[i] = static_cast<int32_t>(file.pt->encoding.bits_per_sample);
+            pLength[i] = file.length == SOX_UNKNOWN_LEN
+                             ? -1
+                             : static_cast<int64_t>(file.length);
+            pEncoding[i] = file.pt->encoding.encoding;
+            pOk[i] = true;
+        } catch (std::runtime_error const&) {
+        }
+    };
+    tbb::task_arena arena(nThreads == 0 ? tbb::task_arena::automatic
+                                        : static_cast<int>(nThreads));
+    arena.execute([&] { tbb::parallel_for(size_t{0}, paths.size(), probe); });
+    return {{"rate", rate},         {"channels", channels},
+            {"bits", bits},         {"length", length},
+            {"encoding", encoding}, {"ok", ok}};
 }
 
-std::pair<Tensor, double> readAudioMemory(void* data, size_t size) {
-    auto file = AudioMemoryFile(data, size);
-    auto wave = file.wave();
-    return {wave, file.rate};
+torch::ScalarType audioDtype(std::string_view name) {
+    if (name == "int16") return torch::kInt16;
+    if (name == "int32") return torch::kInt32;
+    if (name == "float16") return torch::kFloat16;
+    if (name == "bfloat16") return torch::kBFloat16;
+    if (name == "float32") return torch::kFloat32;
+    if (name == "native") return kNativeDtype;
+    throw std::runtime_error("Unknown audio dtype: " + std::string(name));
+}
+
+Tensor pcm32AsDtype(Tensor wave, torch::ScalarType dtype) {
+    switch (dtype) {
+        case torch::kInt32:
+            return wave;
+        case torch::kInt16: {
+            wave = wave.contiguous();
+            auto out = torch::empty(wave.sizes(), torch::kInt16);
+            pcm32ToPCM16(wave.data_ptr<int32_t>(), out.data_ptr<int16_t>(),
+                         static_cast<size_t>(wave.numel()));
+            return out;
+        }
+        case torch::kFloat32:
+            return pcmToFloat32(wave);
+        case torch::kFloat16:
+        case torch::kBFloat16:
+            return pcmToFloat32(wave).to(dtype);
+        default:
+            throw std::runtime_error("Unsupported audio dtype.");
+    }
+}
+
+Tensor pcmToFloat32(Tensor wave) {
+    wave = wave.contiguous();
+    auto out = torch::empty(wave.sizes(), torch::kFloat32);
+    auto n = static_cast<size_t>(wave.numel());
+    if (wave.scalar_type() == torch::kInt16) {
+        pcm16ToFloat32(wave.data_ptr<int16_t>(), out.data_ptr<float>(), n);
+    } else if (wave.scalar_type() == torch::kInt32) {
+        pcm32ToFloat32(wave.data_ptr<int32_t>(), out.data_ptr<float>(), n,
+                       0x1p-31f);
+    } else {
+        throw std::runtime_error(
+            "pcmToFloat32 expects an int16 or int32 wave.");
+    }
+    return out;
+}
+
+Tensor float32ToPCM(Tensor wave, unsigned bits, bool dither) {
+    wave = wave.to(torch::kFloat32).contiguous();
+    auto out = torch::empty(wave.sizes(), torch::kInt32);
+    float32ToPCM32(wave.data_ptr<float>(), out.data_ptr<int32_t>(),
+                   static_cast<size_t>(wave.numel()), bits, dither);
+    return out;
 }
 
 // wave (IntTensor): [nSample, nChannel].
 void wavSavePCM(Tensor wave, std::string_view path, sox_rate_t sr,
-                unsigned int bits) {
+                unsigned int bits, bool dither) {
+    initSox();
+    if (wave.is_floating_point()) {
+        wave = float32ToPCM(wave, bits, dither);
+    }
+    wave = wave.contiguous();
     unsigned channels = wave.size(1);
     size_t length = wave.size(0);
-    sox_signalinfo_t signalinfo{
-        .rate = sr, .channels = channels, .precision = bits, .length = length};
+    sox_signalinfo_t signalinfo{.rate = sr,
+                                .channels = channels,
+                                .precision = bits,
+                                .length = length * channels};
 
     auto pt = sox_open_write(path.data(), &signalinfo, nullptr, "wav", nullptr,
                              [](const char* path) { return sox_true; });
@@ -104,53 +319,216 @@ void wavSavePCM(Tensor wave, std::string_view path, sox_rate_t sr,
                                  std::string(path));
     }
 
-    size_t cnt = sox_write(pt, wave.data_ptr<int32_t>(), length);
+    size_t cnt = sox_write(pt, wave.data_ptr<int32_t>(), length * channels);
+    sox_close(pt);
     if (cnt == 0) {
         throw std::runtime_error("failed to write file at path: " +
                                  std::string(path));
     }
 }
 
+namespace {
+torch::ScalarType transformDtype(bool asFloat32, std::string const& dtype) {
+    if (not dtype.empty()) return audioDtype(dtype);
+    return asFloat32 ? torch::kFloat32 : torch::kInt32;
+}
+
+double readRate(std::string const& path) {
+    if (auto wav = WavFile::open(path)) return wav->rate;
+    return AudioFile(path).rate;
+}
+}  // namespace
+
 struct ReadAudioTransform final : public ItemTransform {
     std::string pathKey;
     std::string waveKey;
     std::string srKey;
-    bool asFloat32;
+    torch::ScalarType dtype;
+    bool lazy;
 
     ReadAudioTransform(std::string pathKey, std::string waveKey,
-                       std::string srKey, bool asFloat32)
+                       std::string srKey, torch::ScalarType dtype, bool lazy)
         : pathKey{pathKey},
           waveKey{waveKey},
           srKey{srKey},
-          asFloat32{asFloat32} {}
+          dtype{dtype},
+          lazy{lazy} {}
+
     Item operator()(Item item) override {
-        auto [w, sr] = readAudio(std::get<std::string>(item[pathKey]));
-        if (asFloat32) {
-            w = w.to(torch::kFloat64) / double(INT_MAX);
-            w = w.to(torch::kFloat32);
+        auto path = std::get<std::string>(item[pathKey]);
+        if (lazy) {
+            // Only the header is read here, the samples are decoded on the
+            // first access of waveKey.
+            item[srKey] = readRate(path);
+            item[waveKey] = lazyValue([path = std::move(path), d = dtype] {
+                return ValueType(readAudio(path, 0, SIZE_MAX, d).first);
+            });
+        } else {
+            auto [wave, rate] = readAudio(path, 0, SIZE_MAX, dtype);
+            item[waveKey] = wave;
+            item[srKey] = rate;
         }
-        item[waveKey] = w;
-        item[srKey] = sr;
         return item;
     }
 };
 
 ItemTransformHandle readAudioTransform(std::string pathKey, std::string waveKey,
-                                       std::string srKey, bool asFloat32) {
-    return std::make_shared<ReadAudioTransform>(pathKey, waveKey, srKey,
-                                                asFloat32);
+                                       std::string srKey, bool asFloat32,
+                                       bool lazy, std::string dtype) {
+    return std::make_shared<ReadAudioTransform>(
+        pathKey, waveKey, srKey, transformDtype(asFloat32, dtype), lazy);
+}
+
+struct ReadAudioSegmentTransform final : public ItemTransform {
+    std::string pathKey;
+    std::string waveKey;
+    std::string srKey;
+    size_t segmentSize;
+    torch::ScalarType dtype;
+    std::string offsetKey;
+    tbb::enumerable_thread_specific<std::mt19937> rng;
+
+    ReadAudioSegmentTransform(std::string pathKey, std::string waveKey,
+                              std::string srKey, size_t segmentSize,
+                              torch::ScalarType dtype, std::string offsetKey)
+        : pathKey{pathKey},
+          waveKey{waveKey},
+          srKey{srKey},
+          segmentSize{segmentSize},
+          dtype{dtype},
+          offsetKey{offsetKey} {}
+
+    Item operator()(Item item) override {
+        bool rngExists;
+        auto& _rng = rng.local(rngExists);
+        if (not rngExists) _rng.seed(std::random_device()());
+
+        auto path = std::get<std::string>(item[pathKey]);
+        auto pick = [&](size_t length) -> size_t {
+            if (length <= segmentSize) return 0;
+            std::uniform_int_distribution<size_t> dist(0,
+                                                       length - segmentSize);
+            return dist(_rng);
+        };
+        size_t offset;
+        if (auto wav = WavFile::open(path)) {
+            offset = pick(wav->length);
+            item[waveKey] =
+                wav->wave(offset, segmentSize, fileDtype(dtype, *wav));
+            item[srKey] = wav->rate;
+        } else {
+            auto file = AudioFile(path);
+            Tensor w;
+            if (file.length == SOX_UNKNOWN_LEN) {
+                // The window can only be placed once the file is decoded.
+                w = file.wave();
+                offset = pick(w.size(0));
+                w = w.narrow(0, static_cast<int64_t>(offset),
+                             std::min<int64_t>(segmentSize, w.size(0)));
+            } else {
+                offset = pick(file.length);
+                w = file.wave(offset, segmentSize);
+            }
+            item[waveKey] = pcm32AsDtype(w, fileDtype(dtype, file));
+            item[srKey] = file.rate;
+        }
+        if (not offsetKey.empty()) {
+            item[offsetKey] = static_cast<int64_t>(offset);
+        }
+        return item;
+    }
+};
+
+ItemTransformHandle readAudioSegmentTransform(std::string pathKey,
+                                              std::string waveKey,
+                                              std::string srKey,
+                                              size_t segmentSize,
+                                              bool asFloat32,
+                                              std::string offsetKey,
+                                              std::string dtype) {
+    return std::make_shared<ReadAudioSegmentTransform>(
+        pathKey, waveKey, srKey, segmentSize,
+        transformDtype(asFloat32, dtype), offsetKey);
+}
+
+struct DecodeAudioTransform final : public ItemTransform {
+    std::string bytesKey;
+    std::string waveKey;
+    std::string srKey;
+    torch::ScalarType dtype;
+
+    DecodeAudioTransform(std::string bytesKey, std::string waveKey,
+                         std::string srKey, torch::ScalarType dtype)
+        : bytesKey{bytesKey}, waveKey{waveKey}, srKey{srKey}, dtype{dtype} {}
+
+    Item operator()(Item item) override {
+        auto bytes = std::get<Tensor>(resolve(item[bytesKey]));
+        auto [wave, rate] = decodeAudio(bytes, dtype);
+        if (bytesKey != waveKey) item.erase(bytesKey);
+        item[waveKey] = wave;
+        item[srKey] = rate;
+        return item;
+    }
+};
+
+ItemTransformHandle decodeAudioTransform(std::string bytesKey,
+                                         std::string waveKey,
+                                         std::string srKey,
+                                         std::string dtype) {
+    return std::make_shared<DecodeAudioTransform>(bytesKey, waveKey, srKey,
+                                                  audioDtype(dtype));
+}
+
+struct EncodeAudioTransform final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    std::string bytesKey;
+    std::string format;
+    unsigned bits;
+
+    EncodeAudioTransform(std::string waveKey, std::string srKey,
+                         std::string bytesKey, std::string format,
+                         unsigned bits)
+        : waveKey{waveKey},
+          srKey{srKey},
+          bytesKey{bytesKey},
+          format{format},
+          bits{bits} {}
+
+    Item operator()(Item item) override {
+        auto wave = std::get<Tensor>(resolve(item[waveKey]));
+        auto rate = std::get<double>(resolve(item[srKey]));
+        auto bytes = encodeAudio(wave, rate, format, bits);
+        if (waveKey != bytesKey) item.erase(waveKey);
+        item[bytesKey] = bytes;
+        return item;
+    }
+};
+
+ItemTransformHandle encodeAudioTransform(std::string waveKey,
+                                         std::string srKey,
+                                         std::string bytesKey,
+                                         std::string format, unsigned bits) {
+    return std::make_shared<EncodeAudioTransform>(waveKey, srKey, bytesKey,
+                                                  format, bits);
 }
 
+// PCM16 values, in an int16 or a widened int32 tensor.
 struct AudioPCM16AsFloat32Transform final : public ItemTransform {
     std::string waveKey;
-    bool asFloat32;
 
     AudioPCM16AsFloat32Transform(std::string waveKey) : waveKey{waveKey} {}
     Item operator()(Item item) override {
-        auto w = std::get<Tensor>(item[waveKey]);
-        if (asFloat32) {
-            w = w.to(torch::kFloat64) / 32768.0;
-            w = w.to(torch::kFloat32);
+        auto w = std::get<Tensor>(resolve(item[waveKey])).contiguous();
+        if (w.scalar_type() == torch::kInt16) {
+            w = pcmToFloat32(w);
+        } else if (w.scalar_type() == torch::kInt32) {
+            auto out = torch::empty(w.sizes(), torch::kFloat32);
+            pcm32ToFloat32(w.data_ptr<int32_t>(), out.data_ptr<float>(),
+                           static_cast<size_t>(w.numel()), 1.0f / 32768.0f);
+            w = out;
+        } else {
+            w = w.to(torch::kFloat32) / 32768.0f;
         }
         item[waveKey] = w;
         return item;
@@ -2,11 +2,13 @@
 #include <sox.h>
 #include <soxr.h>
 
+#include <cstdint>
 #include <mutex>
 #include <string>
 #include <string_view>
 #include <variant>
 
+#include "resample.h"
 #include "types.h"
 
 namespace data {
@@ -14,14 +16,24 @@ namespace data {
 struct AudioFile {
     sox_format_t* pt{};
     sox_rate_t rate{};
+    // Number of frames, a frame holds one sample per channel.
+    // SOX_UNKNOWN_LEN if the header does not tell, e.g. for some MP3 or Ogg
+    // streams.
     size_t length{};
     unsigned channels{};
     std::string path{};
     AudioFile() = default;
     explicit AudioFile(std::string_view path);
 
-    [[nodiscard]] Tensor wave() const;
+    // Decode n frames from offset, or up to the end of the file. Formats
+    // that can seek skip the frames before offset without decoding them.
+    [[nodiscard]] Tensor wave(size_t offset = 0, size_t n = SIZE_MAX) const;
     ~AudioFile() noexcept;
+
+   protected:
+    void readSignal();
+    void skip(size_t offset) const;
+    Tensor readStream(size_t offset, size_t n) const;
 };
 
 struct AudioMemoryFile : AudioFile {
@@ -32,26 +44,100 @@ struct AudioMemoryFile : AudioFile {
 // Read an audio from a file.
 // waveforms in shape [nSample, nChannel].
 // Returns the int32 encoded waveform and the sampling rate.
-std::pair<Tensor, double> readAudio(std::string_view path);
+// With offset and n, only frames [offset, offset + n) are decoded.
+// With dtype, samples are decoded straight into int16, float16, bfloat16
+// or float32 instead, or into the dtype of the file with kNativeDtype, see
+// audioDtype().
+std::pair<Tensor, double> readAudio(std::string_view path, size_t offset = 0,
+                                    size_t n = SIZE_MAX,
+                                    torch::ScalarType dtype = torch::kInt32);
 
 // Read an audio from a memory buffer.
 // waveforms in shape [nSample, nChannel].
 // Returns the int32 encoded waveform and the sampling rate.
-std::pair<Tensor, double> readAudioMemory(void* data, size_t size);
+std::pair<Tensor, double> readAudioMemory(
+    void* data, size_t size, torch::ScalarType dtype = torch::kInt32);
 
-// Resample an audio from in_rate to out_rate.
-// waveforms in shape [nSample, nChannel].
-// Returns the resampled audio.
-// Implemented with soxr, you can change the parameters in the source code.
-Tensor resample(Tensor inWave, double inRate, double outRate);
+// Decode an encoded file held in a ByteTensor, in any format sox reads from
+// memory, e.g. FLAC, Ogg or WAV.
+std::pair<Tensor, double> decodeAudio(Tensor bytes,
+                                      torch::ScalarType dtype = torch::kInt32);
+
+// Encode a wave into a ByteTensor holding a file of the sox type format, e.g.
+// "flac", with bits bits per sample. wave is int32 as read by sox, int16 or
+// float.
+Tensor encodeAudio(Tensor wave, double rate, std::string const& format,
+                   unsigned bits);
+
+// Read the headers of paths in parallel, with nThreads threads, 0 for all
+// cores, without decoding any sample. Returns one column per field, each a
+// tensor with one value per path:
+//     rate: DoubleTensor, in Hz.
+//     channels, bits: IntTensor.
+//     length: LongTensor, in frames, -1 if the header does not tell.
+//     encoding: IntTensor of sox_encoding_t, e.g. SOX_ENCODING_SIGN2.
+//     ok: BoolTensor, false for files that could not be opened, whose other
+//         fields are 0.
+Item probeAudio(StringList const& paths, size_t nThreads);
+
+// Decode into the dtype holding the samples of the file without loss: int16
+// for up to 16 bits per sample, float32 for float encodings, int32 otherwise,
+// e.g. for 24 bits or for lossy formats.
+inline constexpr torch::ScalarType kNativeDtype = torch::ScalarType::Undefined;
+
+// A sample dtype by name: "int16", "int32", "float16", "bfloat16",
+// "float32", or "native" for kNativeDtype.
+// resample() takes int16, int32 or float32 waves, and the augmentations of
+// augment.h float32 only, convert float16 and bfloat16 waves before them.
+torch::ScalarType audioDtype(std::string_view name);
+
+// Convert a wave as read by sox, int32 aligned to the top bits, to dtype.
+Tensor pcm32AsDtype(Tensor wave, torch::ScalarType dtype);
+
+// int16 PCM, or int32 aligned to the top bits as read by sox, to float32 in
+// [-1, 1).
+Tensor pcmToFloat32(Tensor wave);
+
+// float32 in [-1, 1] to int32 aligned to the top bits, rounded to bits bits
+// with optional triangular dither.
+Tensor float32ToPCM(Tensor wave, unsigned bits, bool dither);
 
-// Save a waveform to target path. wave is IntTensor[nSample, nChannel].
+// Save a waveform to target path. wave is IntTensor[nSample, nChannel], or a
+// float tensor quantized to bits with float32ToPCM.
 void wavSavePCM(Tensor wave, std::string_view path, sox_rate_t sr,
-                unsigned int bits);
+                unsigned int bits, bool dither = false);
 
+// With lazy, only the header is read by the transform, and the waveform is a
+// LazyValue decoded on first access. Items dropped before that never decode.
+// A non-empty dtype overrides asFloat32, e.g. "int16" keeps PCM16 sources at
+// half the memory of int32, "native" keeps the precision of each file.
 ItemTransformHandle readAudioTransform(std::string path_key,
                                        std::string wave_key, std::string sr_key,
-                                       bool asFloat32);
+                                       bool asFloat32, bool lazy,
+                                       std::string dtype = "");
+// Decode a random window of segmentSize frames, placed from the length in
+// the header, so the rest of the file is never decoded. Shorter files are
+// read whole. With offsetKey, the first frame of the window is stored there.
+ItemTransformHandle readAudioSegmentTransform(std::string pathKey,
+                                              std::string waveKey,
+                                              std::string srKey,
+                                              size_t segmentSize,
+                                              bool asFloat32,
+                                              std::string offsetKey,
+                                              std::string dtype = "");
+// Decode the ByteTensor in bytesKey into waveKey, and its rate into srKey.
+// Encoded audio stored in shards is much smaller than PCM, at the cost of
+// decoding it in the loader threads.
+ItemTransformHandle decodeAudioTransform(std::string bytesKey,
+                                         std::string waveKey,
+                                         std::string srKey,
+                                         std::string dtype);
+// Encode waveKey at the rate in srKey into bytesKey, removing waveKey, e.g.
+// before saveShard.
+ItemTransformHandle encodeAudioTransform(std::string waveKey,
+                                         std::string srKey,
+                                         std::string bytesKey,
+                                         std::string format, unsigned bits);
 ItemTransformHandle audioPCM16AsFloat32(std::string waveKey);
 
 }  // namespace data
\ No newline at end of file
@@ -0,0 +1,317 @@
+#include "augment.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+#include "audio.h"
+#include "features.h"
+
+namespace data {
+
+namespace {
+std::mt19937& rng() {
+    static thread_local auto rng = std::mt19937(std::random_device()());
+    return rng;
+}
+
+bool draw(double probability) {
+    return std::bernoulli_distribution(probability)(rng());
+}
+
+Tensor& floatWave(Item& item, std::string const& key) {
+    auto& wave = std::get<Tensor>(resolve(item[key]));
+    if (wave.scalar_type() != torch::kFloat32) {
+        throw std::runtime_error("Augmentation expects a float32 wave in " +
+                                 key);
+    }
+    return wave;
+}
+
+// The wave in key as a contiguous [nSample, nChannel] tensor to modify in
+// place, a view of the one in the item. Items of in-memory datasets share
+// their tensors with the dataset, so a wave that anything else refers to is
+// copied first.
+Tensor writableWave(Item& item, std::string const& key) {
+    auto& slot = floatWave(item, key);
+    auto wave = std::move(slot);
+    bool owned = wave.use_count() == 1 and wave.storage().use_count() == 1;
+    slot = owned ? wave.contiguous()
+                 : wave.clone(torch::MemoryFormat::Contiguous);
+    return slot.dim() == 1 ? slot.unsqueeze(1) : slot;
+}
+
+// Next index in a clip of len samples, looping to the start.
+int64_t next(int64_t j, int64_t len) { return j + 1 == len ? 0 : j + 1; }
+
+void checkBankRate(char const* name, double sr, AudioBank const& bank) {
+    if (sr != bank.sampleRate()) {
+        throw std::runtime_error(std::string(name) + " got a sample rate of " +
+                                 std::to_string(sr) + ", the bank is at " +
+                                 std::to_string(bank.sampleRate()));
+    }
+}
+}  // namespace
+
+AudioBank::AudioBank(std::vector<Tensor> const& clips, double sampleRate)
+    : rate{sampleRate} {
+    offsets.reserve(clips.size() + 1);
+    offsets.push_back(0);
+    std::vector<Tensor> parts;
+    parts.reserve(clips.size());
+    for (auto const& clip : clips) {
+        auto x = monoFloat32(clip);
+        if (x.size(0) == 0) throw std::runtime_error("Empty audio bank clip.");
+        offsets.push_back(offsets.back() + x.size(0));
+        parts.push_back(x);
+    }
+    arena = parts.empty() ? torch::empty({0}, torch::kFloat32)
+                          : torch::cat(parts);
+}
+
+std::shared_ptr<AudioBank> AudioBank::load(StringList const& paths,
+                                           double sampleRate,
+                                           size_t nThreads) {
+    std::vector<Tensor> clips(paths.size());
+    auto read = [&](size_t i) {
+        auto [wave, sr] = readAudio(paths[i], 0, SIZE_MAX, torch::kFloat32);
+        auto x = monoFloat32(wave).unsqueeze(1);
+        if (sr != sampleRate) x = resample(x, sr, sampleRate);
+        clips[i] = x.select(1, 0);
+    };
+    tbb::task_arena arena(nThreads == 0 ? tbb::task_arena::automatic
+                                        : static_cast<int>(nThreads));
+    arena.execute([&] { tbb::parallel_for(size_t{0}, paths.size(), read); });
+    return std::make_shared<AudioBank>(clips, sampleRate);
+}
+
+Tensor AudioBank::clip(size_t i) const {
+    if (i >= size()) throw std::out_of_range("AudioBank clip out of range.");
+    return arena.narrow(0, offsets[i], offsets[i + 1] - offsets[i]);
+}
+
+struct AddNoise final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    AudioBankHandle noises;
+    double snrMin;
+    double snrMax;
+    double probability;
+
+    AddNoise(std::string waveKey, std::string srKey, AudioBankHandle noises,
+             double snrMin, double snrMax, double probability)
+        : waveKey{waveKey},
+          srKey{srKey},
+          noises{noises},
+          snrMin{snrMin},
+          snrMax{snrMax},
+          probability{probability} {
+        if (noises->size() == 0) {
+            throw std::runtime_error("addNoiseTransform got no noise.");
+        }
+    }
+
+    Item operator()(Item item) override {
+        if (not draw(probability)) return item;
+        checkBankRate("addNoiseTransform",
+                      std::get<double>(resolve(item[srKey])), *noises);
+        auto wave = writableWave(item, waveKey);
+        auto n = wave.size(0), channels = wave.size(1);
+        if (n == 0) return item;
+        auto pick = std::uniform_int_distribution<size_t>(
+            0, noises->size() - 1)(rng());
+        auto clip = noises->clip(pick);
+        auto len = clip.size(0);
+        auto start = std::uniform_int_distribution<int64_t>(0, len - 1)(rng());
+        auto snr =
+            std::uniform_real_distribution<double>(snrMin, snrMax)(rng());
+
+        auto pw = wave.data_ptr<float>();
+        auto pn = clip.data_ptr<float>();
+        double signal = 0, noise = 0;
+        for (int64_t i = 0; i < n * channels; ++i) {
+            signal += static_cast<double>(pw[i]) * pw[i];
+        }
+        for (int64_t i = 0, j = start; i < n; ++i, j = next(j, len)) {
+            noise += static_cast<double>(pn[j]) * pn[j];
+        }
+        signal /= n * channels;
+        noise /= n;
+        if (signal == 0 or noise == 0) return item;
+        auto scale = static_cast<float>(
+            std::sqrt(signal / (noise * std::pow(10.0, snr / 10))));
+        for (int64_t i = 0, j = start; i < n; ++i, j = next(j, len)) {
+            auto v = scale * pn[j];
+            for (int64_t c = 0; c < channels; ++c) pw[i * channels + c] += v;
+        }
+        return item;
+    }
+};
+
+ItemTransformHandle addNoiseTransform(std::string waveKey, std::string srKey,
+                                      AudioBankHandle noises, double snrMin,
+                                      double snrMax, double probability) {
+    return std::make_shared<AddNoise>(waveKey, srKey, noises, snrMin, snrMax,
+                                      probability);
+}
+
+struct Reverb final : public ItemTransform {
+    // A RIR prepared for overlap-add: blocks of block samples are convolved
+    // through FFTs of nFft points, nFft >= block + length - 1.
+    struct Filter {
+        Tensor spectrum;
+        int64_t length;
+        int64_t nFft;
+        int64_t block;
+    };
+
+    std::string waveKey;
+    std::string srKey;
+    AudioBankHandle rirs;
+    double probability;
+    std::vector<Filter> filters;
+
+    Reverb(std::string waveKey, std::string srKey, AudioBankHandle rirs,
+           double probability)
+        : waveKey{waveKey},
+          srKey{srKey},
+          rirs{rirs},
+          probability{probability} {
+        if (rirs->size() == 0) {
+            throw std::runtime_error("reverbTransform got no RIR.");
+        }
+        // The spectra are computed once, for all threads.
+        for (size_t i = 0; i < rirs->size(); ++i) {
+            auto rir = rirs->clip(i);
+            auto peak = rir.abs().argmax().item<int64_t>();
+            rir = rir.narrow(0, peak, rir.size(0) - peak);
+            auto norm = rir.norm().item<double>();
+            if (norm > 0) rir = rir / norm;
+            Filter f;
+            f.length = rir.size(0);
+            f.nFft = 256;
+            while (f.nFft < 2 * f.length) f.nFft *= 2;
+            f.block = f.nFft - f.length + 1;
+            f.spectrum = torch::fft::rfft(rir, f.nFft);
+            filters.push_back(std::move(f));
+        }
+    }
+
+    Item operator()(Item item) override {
+        if (not draw(probability)) return item;
+        checkBankRate("reverbTransform",
+                      std::get<double>(resolve(item[srKey])), *rirs);
+        auto wave = writableWave(item, waveKey);
+        auto n = wave.size(0), channels = wave.size(1);
+        if (n == 0) return item;
+        auto const& f = filters[std::uniform_int_distribution<size_t>(
+            0, filters.size() - 1)(rng())];
+
+        // All blocks of all channels go through one batched FFT.
+        auto nBlock = (n + f.block - 1) / f.block;
+        auto x = torch::zeros({channels, nBlock * f.block}, torch::kFloat32);
+        x.narrow(1, 0, n).copy_(wave.t());
+        auto blocks = torch::fft::irfft(
+            torch::fft::rfft(x.view({channels, nBlock, f.block}), f.nFft) *
+                f.spectrum,
+            f.nFft);
+        // Overlap-add the blocks, dropping the tail past the wave.
+        auto y = torch::zeros({channels, n}, torch::kFloat32);
+        auto pb = blocks.data_ptr<float>();
+        auto py = y.data_ptr<float>();
+        for (int64_t c = 0; c < channels; ++c) {
+            for (int64_t b = 0; b < nBlock; ++b) {
+                auto src = pb + (c * nBlock + b) * f.nFft;
+                auto dst = py + c * n + b * f.block;
+                auto m = std::min(f.nFft, n - b * f.block);
+                for (int64_t j = 0; j < m; ++j) dst[j] += src[j];
+            }
+        }
+        wave.copy_(y.t());
+        return item;
+    }
+};
+
+ItemTransformHandle reverbTransform(std::string waveKey, std::string srKey,
+                                    AudioBankHandle rirs, double probability) {
+    return std::make_shared<Reverb>(waveKey, srKey, rirs, probability);
+}
+
+struct Gain final : public ItemTransform {
+    std::string waveKey;
+    double minDb;
+    double maxDb;
+    double probability;
+
+    Gain(std::string waveKey, double minDb, double maxDb, double probability)
+        : waveKey{waveKey},
+          minDb{minDb},
+          maxDb{maxDb},
+          probability{probability} {}
+
+    Item operator()(Item item) override {
+        if (not draw(probability)) return item;
+        auto db = std::uniform_real_distribution<double>(minDb, maxDb)(rng());
+        writableWave(item, waveKey).mul_(std::pow(10.0, db / 20));
+        return item;
+    }
+};
+
+ItemTransformHandle gainTransform(std::string waveKey, double minDb,
+                                  double maxDb, double probability) {
+    return std::make_shared<Gain>(waveKey, minDb, maxDb, probability);
+}
+
+struct Speed final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    std::vector<double> factors;
+    ResampleQuality quality;
+    double probability;
+
+    Speed(std::string waveKey, std::string srKey, std::vector<double> factors,
+          ResampleQuality quality, double probability)
+        : waveKey{waveKey},
+          srKey{srKey},
+          factors{std::move(factors)},
+          quality{quality},
+          probability{probability} {
+        if (this->factors.empty()) {
+            throw std::runtime_error("speedTransform got no factor.");
+        }
+        for (auto f : this->factors) {
+            if (f <= 0) throw std::runtime_error("Invalid speed factor.");
+        }
+    }
+
+    Item operator()(Item item) override {
+        if (not draw(probability)) return item;
+        auto factor = factors[std::uniform_int_distribution<size_t>(
+            0, factors.size() - 1)(rng())];
+        if (factor == 1) return item;
+        auto sr = std::get<double>(resolve(item[srKey]));
+        auto wave = floatWave(item, waveKey);
+        auto mono = wave.dim() == 1;
+        // Taking the wave as recorded at sr * factor and resampling it to sr
+        // plays it factor times faster.
+        auto out =
+            resample(mono ? wave.unsqueeze(1) : wave, sr * factor, sr, quality);
+        item[waveKey] = mono ? out.select(1, 0) : out;
+        return item;
+    }
+};
+
+ItemTransformHandle speedTransform(std::string waveKey, std::string srKey,
+                                   std::vector<double> factors,
+                                   ResampleQuality quality,
+                                   double probability) {
+    return std::make_shared<Speed>(waveKey, srKey, std::move(factors),
+                                   quality, probability);
+}
+
+}  // namespace data
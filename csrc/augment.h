@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "resample.h"
+#include "types.h"
+
+/*
+Waveform augmentation in the loader threads. Waves are float32
+[nSample, nChannel]. Transforms that keep the length modify the wave in
+place when the item is its only owner, and otherwise a copy, so waves shared
+with a dataset or other items are left as they are. Each transform is
+applied with a probability, and draws its parameters from a per-thread
+generator.
+*/
+
+namespace data {
+
+// Mono float32 clips at one sample rate, e.g. noises or room impulse
+// responses, packed in one arena. The bank is read-only once built, and is
+// shared by the transforms of all threads.
+class AudioBank {
+   public:
+    AudioBank(std::vector<Tensor> const& clips, double sampleRate);
+    // Read paths in parallel with nThreads threads, 0 for all cores, mixed
+    // down to mono and resampled to sampleRate.
+    static std::shared_ptr<AudioBank> load(StringList const& paths,
+                                           double sampleRate, size_t nThreads);
+
+    size_t size() const { return offsets.size() - 1; }
+    double sampleRate() const { return rate; }
+    // Clip i, FloatTensor[n], a view of the arena.
+    Tensor clip(size_t i) const;
+
+   private:
+    double rate;
+    Tensor arena;
+    std::vector<int64_t> offsets;
+};
+
+using AudioBankHandle = std::shared_ptr<AudioBank>;
+
+// Add a random clip of noises at a random offset, looped if shorter than the
+// wave, at an SNR drawn in [snrMin, snrMax] dB. Throws if srKey does not
+// match the rate of the bank.
+ItemTransformHandle addNoiseTransform(std::string waveKey, std::string srKey,
+                                      AudioBankHandle noises, double snrMin,
+                                      double snrMax, double probability);
+// Convolve with a random room impulse response of rirs, keeping the length of
+// the wave. RIRs are cut before their peak, so the direct path is not
+// delayed, and normalized to unit energy. Throws if srKey does not match the
+// rate of the bank.
+ItemTransformHandle reverbTransform(std::string waveKey, std::string srKey,
+                                    AudioBankHandle rirs, double probability);
+// Scale by a gain drawn in [minDb, maxDb].
+ItemTransformHandle gainTransform(std::string waveKey, double minDb,
+                                  double maxDb, double probability);
+// Speed perturbation as in Kaldi: play the wave faster by a factor drawn from
+// factors, e.g. {0.9, 1.0, 1.1}, changing both its length and pitch. The wave
+// is replaced, resampled with the cached resamplers of resample().
+ItemTransformHandle speedTransform(std::string waveKey, std::string srKey,
+                                   std::vector<double> factors,
+                                   ResampleQuality quality, double probability);
+
+}  // namespace data
@@ -1,39 +1,107 @@
 #include "dataset.h"
 
+#include <tbb/parallel_for.h>
 #include <torch/script.h>
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <numeric>
 #include <ranges>
 #include <stdexcept>
+#include <thread>
+#include <variant>
 
+#include "reorder.h"
+#include "trace.h"
 #include "types.h"
 
 namespace data {
 
+std::vector<bool> Dataset::select(ItemPredicateHandle pred) {
+    auto n = size();
+    // std::vector<bool> can not be written concurrently.
+    std::vector<char> bits(n, 0);
+    auto fieldPred = std::dynamic_pointer_cast<FieldPredicate>(pred);
+    tbb::parallel_for(size_t{0}, n, [&](size_t idx) {
+        auto key = getKey(idx);
+        if (fieldPred != nullptr) {
+            if (fieldPred->field == "key") {
+                bits[idx] = fieldPred->test(std::string(key));
+                return;
+            }
+            if (auto v = metadata(key, fieldPred->field)) {
+                bits[idx] = fieldPred->test(loaded(*v));
+                return;
+            }
+        }
+        auto item = getItem(idx);
+        item.insert_or_assign("key", std::string(key));
+        bits[idx] = (*pred)(item);
+    });
+    return std::vector<bool>(bits.begin(), bits.end());
+}
+
+DatasetHandle Dataset::where(ItemPredicateHandle pred) {
+    auto bits = select(std::move(pred));
+    std::vector<size_t> indices;
+    for (size_t idx = 0; idx < bits.size(); ++idx) {
+        if (bits[idx]) indices.push_back(idx);
+    }
+    if (indices.empty()) {
+        throw std::runtime_error("No item passes the predicate of where().");
+    }
+    return subsetDataset(shared_from_this(), std::move(indices));
+}
+
+// Items are stored with their key in "key", as samplers hand them out, so
+// sampling shares them instead of copying. added[idx] is set when the key was
+// added by the dataset, it is removed again from the copies of getItem().
 struct ImmediateDataset final : Dataset {
-    ItemList imm;
+    std::vector<SharedItem> imm;
+    std::vector<bool> added;
     ImmediateDataset(ItemDict items) {
         keys.reserve(items.size());
         imm.reserve(items.size());
+        added.reserve(items.size());
         for (auto&& p : items) {
             auto&& [k, v] = p;
-            keys.emplace_back(std::move(k));
+            keys.emplace_back(k);
+            added.push_back(v.try_emplace("key", k).second);
             imm.emplace_back(std::move(v));
         }
     }
-    Item operator[](std::string_view key) override {
+    size_t indexOf(std::string_view key) {
         auto iter = std::lower_bound(keys.begin(), keys.end(), key);
         if (iter == keys.end())
             throw std::out_of_range("ImmediateDataset [] out of range");
-        auto idx = iter - keys.begin();
-        return imm[idx];
+        return iter - keys.begin();
+    }
+    Item operator[](std::string_view key) override {
+        return getItem(indexOf(key));
+    }
+    Item getItem(size_t idx) override {
+        Item item = *imm.at(idx);
+        if (added[idx]) item.erase("key");
+        return item;
+    }
+    SharedItem sharedItem(std::string_view key) override {
+        return imm[indexOf(key)];
+    }
+    SharedItem getSharedItem(size_t idx) override { return imm.at(idx); }
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        auto const& item = *imm[indexOf(key)];
+        auto it = item.find(std::string(field));
+        if (it == item.end()) return std::nullopt;
+        return it->second;
     }
-    Item getItem(size_t idx) override { return imm.at(idx); }
 };
 
 DatasetHandle immediateDataset(ItemDict items) {
-    return std::make_shared<ImmediateDataset>(items);
+    return instrument(std::make_shared<ImmediateDataset>(std::move(items)),
+                      "immediate", {});
 }
 
 struct ZippedDataset final : Dataset {
@@ -48,14 +116,23 @@ struct ZippedDataset final : Dataset {
         return item;
     }
 
+    // Later datasets take precedence, as in operator[].
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        for (auto& p_base : std::ranges::reverse_view(p_bases)) {
+            if (auto v = p_base->metadata(key, field)) return v;
+        }
+        return std::nullopt;
+    }
+
     ZippedDataset(DatasetList const& datasets) : p_bases{std::move(datasets)} {
         // Compute the common keys:
-        KeyList common_keys = datasets[0]->keys;
+        KeyList common_keys = datasets[0]->keyList();
         for (int i = 1; i < datasets.size(); ++i) {
             KeyList buffer;
             std::set_intersection(common_keys.begin(), common_keys.end(),
-                                  datasets[i]->keys.begin(),
-                                  datasets[i]->keys.end(),
+                                  datasets[i]->keyList().begin(),
+                                  datasets[i]->keyList().end(),
                                   std::back_inserter(buffer));
             std::swap(buffer, common_keys);
             buffer.clear();
@@ -66,7 +143,10 @@ struct ZippedDataset final : Dataset {
 
 DatasetHandle zipDatasets(DatasetList const& datasets) {
     assert(datasets.size() > 1);
-    return std::make_shared<ZippedDataset>(datasets);
+    std::vector<StageStatsHandle> inputs;
+    for (auto const& d : datasets) inputs.push_back(d->stageStats());
+    return instrument(std::make_shared<ZippedDataset>(datasets), "zip",
+                      std::move(inputs));
 }
 
 struct UnionedDataset final : Dataset {
@@ -79,7 +159,7 @@ struct UnionedDataset final : Dataset {
 
         // First compute the union of keys.
         for (int i = 0; i < datasets.size(); ++i) {
-            for (const auto& key : datasets[i]->keys) {
+            for (const auto& key : datasets[i]->keyList()) {
                 key_ids.emplace_back(key, i);
                 keys.emplace_back(key);
             }
@@ -105,18 +185,40 @@ struct UnionedDataset final : Dataset {
             throw std::runtime_error("Key not found in unioned_datasets.");
         }
     }
+
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        auto it = std::lower_bound(
+            key_ids.begin(), key_ids.end(), key,
+            [](const auto& pair, const auto& k) { return pair.first < k; });
+        if (it != key_ids.end() && it->first == key) {
+            return p_bases[it->second]->metadata(key, field);
+        }
+        return std::nullopt;
+    }
+
+    // Each base is a partition, key_ids is in the order of keys.
+    std::vector<int> partitions() override {
+        std::vector<int> p;
+        p.reserve(key_ids.size());
+        for (auto const& [key, id] : key_ids) p.push_back(id);
+        return p;
+    }
 };
 
 // The user is responsible to ensure that the keys do not overlap.
 DatasetHandle unionDatasets(DatasetList const& datasets) {
-    return std::make_shared<UnionedDataset>(datasets);
+    std::vector<StageStatsHandle> inputs;
+    for (auto const& d : datasets) inputs.push_back(d->stageStats());
+    return instrument(std::make_shared<UnionedDataset>(datasets), "union",
+                      std::move(inputs));
 }
 
 struct PrefixedDataset final : Dataset {
     DatasetHandle base;
     size_t prefix_length;
     PrefixedDataset(DatasetHandle base, std::string_view prefix)
-        : Dataset{base->keys},
+        : Dataset{base->keyList()},
           base{std::move(base)},
           prefix_length(prefix.length()) {
         for (auto& key : keys) {
@@ -128,47 +230,133 @@ struct PrefixedDataset final : Dataset {
         std::string_view stripped_key = key.substr(prefix_length);
         return (*base)[stripped_key];
     }
+
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        return base->metadata(key.substr(prefix_length), field);
+    }
+
+    std::vector<int> partitions() override { return base->partitions(); }
 };
 
 DatasetHandle prefixDataset(DatasetHandle base, std::string_view prefix) {
-    return std::make_shared<PrefixedDataset>(base, prefix);
+    auto inputs = std::vector{base->stageStats()};
+    return instrument(std::make_shared<PrefixedDataset>(base, prefix),
+                      "prefix", std::move(inputs));
 }
 
 struct MappedDataset final : Dataset {
     DatasetHandle base;
     ItemTransformHandle func;
     MappedDataset(DatasetHandle base, ItemTransformHandle func)
-        : Dataset{base->keys}, base{std::move(base)}, func{std::move(func)} {}
+        : Dataset{base->keyList()},
+          base{std::move(base)},
+          func{std::move(func)} {}
     Item operator[](std::string_view key) override {
         auto&& b = *base;
         return (*func)(b[key]);
     }
+    std::vector<int> partitions() override { return base->partitions(); }
 };
 
 DatasetHandle mapDataset(DatasetHandle base, ItemTransformHandle func) {
-    return std::make_shared<MappedDataset>(std::move(base), std::move(func));
+    auto inputs = std::vector{base->stageStats()};
+    return instrument(
+        std::make_shared<MappedDataset>(std::move(base), std::move(func)),
+        "map", std::move(inputs));
 }
 
 struct FilteredDataset final : Dataset {
     DatasetHandle base;
     KeyPredicateHandle pred;
     FilteredDataset(DatasetHandle base, KeyPredicateHandle pred)
-        : Dataset{base->keys}, base{std::move(base)}, pred{std::move(pred)} {
+        : Dataset{base->keyList()},
+          base{std::move(base)},
+          pred{std::move(pred)} {
         keys.erase(std::remove_if(keys.begin(), keys.end(),
                                   [pred](auto x) { return not(*pred)(x); }),
                    keys.end());
     }
+    // The predicate is evaluated once in the constructor, lookups only search
+    // the filtered keys.
     Item operator[](std::string_view key) override {
-        if ((*pred)(key)) {
+        if (contains(key)) {
             return (*base)[key];
         } else {
             throw std::runtime_error("Key not found in FilteredDataset");
         }
     }
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        if (not contains(key)) return std::nullopt;
+        return base->metadata(key, field);
+    }
+    std::vector<int> partitions() override {
+        auto q = base->partitions();
+        if (q.empty()) return q;
+        std::vector<int> p;
+        p.reserve(keys.size());
+        auto const& baseKeys = base->keyList();
+        auto it = baseKeys.begin();
+        for (auto const& key : keys) {
+            it = std::lower_bound(it, baseKeys.end(), key);
+            p.push_back(q[it - baseKeys.begin()]);
+        }
+        return p;
+    }
 };
 
 DatasetHandle filterDataset(DatasetHandle base, KeyPredicateHandle pred) {
-    return std::make_shared<FilteredDataset>(std::move(base), std::move(pred));
+    auto inputs = std::vector{base->stageStats()};
+    return instrument(
+        std::make_shared<FilteredDataset>(std::move(base), std::move(pred)),
+        "filter", std::move(inputs));
+}
+
+// The items of base at the given sorted indices.
+struct SubsetDataset final : Dataset {
+    DatasetHandle base;
+    std::vector<size_t> indices;
+    SubsetDataset(DatasetHandle base, std::vector<size_t> indices)
+        : base{std::move(base)}, indices{std::move(indices)} {
+        keys.reserve(this->indices.size());
+        for (auto idx : this->indices) {
+            keys.emplace_back(this->base->getKey(idx));
+        }
+    }
+    Item operator[](std::string_view key) override {
+        if (contains(key)) {
+            return (*base)[key];
+        } else {
+            throw std::runtime_error("Key not found in SubsetDataset");
+        }
+    }
+    Item getItem(size_t idx) override {
+        return base->getItem(indices.at(idx));
+    }
+    SharedItem getSharedItem(size_t idx) override {
+        return base->getSharedItem(indices.at(idx));
+    }
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        if (not contains(key)) return std::nullopt;
+        return base->metadata(key, field);
+    }
+    std::vector<int> partitions() override {
+        auto q = base->partitions();
+        if (q.empty()) return q;
+        std::vector<int> p;
+        p.reserve(indices.size());
+        for (auto idx : indices) p.push_back(q[idx]);
+        return p;
+    }
+};
+
+DatasetHandle subsetDataset(DatasetHandle base, std::vector<size_t> indices) {
+    auto inputs = std::vector{base->stageStats()};
+    return instrument(
+        std::make_shared<SubsetDataset>(std::move(base), std::move(indices)),
+        "subset", std::move(inputs));
 }
 
 struct LoadedShard final : Dataset {
@@ -183,6 +371,21 @@ struct LoadedShard final : Dataset {
         }
     }
 
+    // Scalar attributes are read without building the whole item.
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        auto const& item_module = m.attr(key.data()).toModule();
+        auto name = std::string(field);
+        if (not item_module.hasattr(name)) return std::nullopt;
+        auto const& value = item_module.attr(name);
+        if (value.isBool()) return value.toBool();
+        if (value.isInt()) return value.toInt();
+        if (value.isDouble()) return value.toDouble();
+        if (value.isString()) return value.toStringRef();
+        if (value.isTensor()) return value.toTensor();
+        return std::nullopt;
+    }
+
     Item operator[](std::string_view key) override {
         auto const& item_module = m.attr(key.data()).toModule();
         auto const& lst = item_module.named_attributes(false);
@@ -193,7 +396,9 @@ struct LoadedShard final : Dataset {
             if (i >= 2) {
                 auto name = (*it).name;
                 auto const& value = (*it).value;
-                if (value.isInt()) {
+                if (value.isBool()) {
+                    item[name] = value.toBool();
+                } else if (value.isInt()) {
                     item[name] = value.toInt();
                 } else if (value.isDouble()) {
                     item[name] = value.toDouble();
@@ -211,8 +416,132 @@ struct LoadedShard final : Dataset {
     }
 };
 
+// Items are submodules of the shard module, and values are attributes of the
+// items. As in scripted nn.Modules, the first two attributes of an item are
+// "training" and "_is_full_backward_hook", LoadedShard skips them.
+void saveShard(ItemDict const& items, std::string const& path) {
+    auto cu = std::make_shared<torch::jit::CompilationUnit>();
+    torch::jit::Module shard(c10::QualifiedName("__torch__.Shard"), cu, true);
+    shard.register_attribute("training", c10::BoolType::get(), true);
+    shard.register_attribute("_is_full_backward_hook",
+                             c10::OptionalType::create(c10::BoolType::get()),
+                             IValue());
+    for (auto const& [key, item] : items) {
+        torch::jit::Module m(c10::QualifiedName("__torch__.ShardItem"), cu,
+                             true);
+        m.register_attribute("training", c10::BoolType::get(), true);
+        m.register_attribute("_is_full_backward_hook",
+                             c10::OptionalType::create(c10::BoolType::get()),
+                             IValue());
+        for (auto const& [name, value] : item) {
+            auto const& v = loaded(value);
+            if (auto p = std::get_if<bool>(&v)) {
+                m.register_attribute(name, c10::BoolType::get(), *p);
+            } else if (auto p = std::get_if<int64_t>(&v)) {
+                m.register_attribute(name, c10::IntType::get(), *p);
+            } else if (auto p = std::get_if<double>(&v)) {
+                m.register_attribute(name, c10::FloatType::get(), *p);
+            } else if (auto p = std::get_if<std::string>(&v)) {
+                m.register_attribute(name, c10::StringType::get(), *p);
+            } else if (auto p = std::get_if<Tensor>(&v)) {
+                m.register_attribute(name, c10::TensorType::get(), *p);
+            } else {
+                throw std::runtime_error(
+                    "Found unsupported value type in shard item.");
+            }
+        }
+        shard.register_module(key, m);
+    }
+    shard.save(path);
+}
+
+// Not instrumented, shards are loaded on every rotation of a shard sampler,
+// which records the load latency in its gauges.
 DatasetHandle loadShard(std::string_view path) {
     return std::make_shared<LoadedShard>(path);
 }
 
+// Workers claim positions of order one at a time. Results are numbered by
+// position if ordered, otherwise by completion, and pass through a
+// ReorderBuffer of window entries.
+struct ParallelDatasetIterator final : DatasetIterator {
+    using Entry = std::variant<Item, std::exception_ptr>;
+    DatasetHandle d;
+    std::vector<size_t> order;
+    bool ordered;
+    std::atomic<size_t> nextIn{0};
+    std::atomic<size_t> nextDone{0};
+    ReorderBuffer<Entry> buffer;
+    std::vector<std::jthread> workers;
+
+    ParallelDatasetIterator(DatasetHandle d, size_t nThreads, bool ordered,
+                            bool shardAware)
+        : d{std::move(d)}, ordered{ordered}, buffer(4 * nThreads) {
+        if (nThreads == 0) {
+            throw std::runtime_error("Iterating with no worker threads.");
+        }
+        order.resize(this->d->size());
+        std::iota(order.begin(), order.end(), size_t{0});
+        if (shardAware) {
+            auto p = this->d->partitions();
+            if (not p.empty()) {
+                std::stable_sort(
+                    order.begin(), order.end(),
+                    [&](size_t a, size_t b) { return p[a] < p[b]; });
+            }
+        }
+        for (size_t i = 0; i < nThreads; ++i) {
+            workers.emplace_back([this] {
+                setTraceThreadName("iterate worker");
+                while (produce()) {
+                }
+            });
+        }
+    }
+
+    // Load one item, returns false at the end or once closed.
+    bool produce() {
+        auto pos = nextIn.fetch_add(1);
+        if (pos >= order.size()) return false;
+        if (ordered and not buffer.acquire(pos)) return false;
+        Entry entry;
+        try {
+            auto idx = order[pos];
+            auto item = d->getItem(idx);
+            item.insert_or_assign("key", std::string(d->getKey(idx)));
+            entry = materialize(std::move(item));
+        } catch (...) {
+            entry = std::current_exception();
+        }
+        if (not ordered) {
+            pos = nextDone.fetch_add(1);
+            if (not buffer.acquire(pos)) return false;
+        }
+        buffer.put(pos, std::move(entry));
+        return true;
+    }
+
+    std::optional<Item> next() override {
+        auto entry = buffer.take(order.size());
+        if (not entry) return std::nullopt;
+        if (auto e = std::get_if<std::exception_ptr>(&*entry)) {
+            std::rethrow_exception(*e);
+        }
+        return std::get<Item>(std::move(*entry));
+    }
+
+    size_t size() override { return order.size(); }
+
+    virtual ~ParallelDatasetIterator() {
+        // Workers waiting for the consumer wake up and exit.
+        buffer.close();
+    }
+};
+
+DatasetIteratorHandle iterateDataset(DatasetHandle d, size_t nThreads,
+                                     bool ordered, bool shardAware) {
+    return std::make_shared<ParallelDatasetIterator>(std::move(d), nThreads,
+                                                     ordered, shardAware);
+}
+
 }  // namespace data
\ No newline at end of file
@@ -1,4 +1,8 @@
 #pragma once
+#include <optional>
+#include <vector>
+
+#include "item.h"
 #include "sampler.h"
 #include "types.h"
 
@@ -7,18 +11,38 @@ namespace data {
 // Helper functions:
 DatasetHandle immediateDataset(ItemDict items);
 DatasetHandle loadShard(std::string_view path);
+// Save items as a TorchScript shard readable by loadShard, in the same format
+// as torchdataxx.shard.save_shard. Values must be bool, int, float, string or
+// Tensor.
+void saveShard(ItemDict const& items, std::string const& path);
 
 DatasetHandle mapDataset(DatasetHandle d, ItemTransformHandle func);
 DatasetHandle filterDataset(DatasetHandle d, KeyPredicateHandle pred);
 DatasetHandle zipDatasets(DatasetList const& datasets);
 DatasetHandle unionDatasets(DatasetList const& datasets);
 DatasetHandle prefixDataset(DatasetHandle d, std::string_view prefix);
+DatasetHandle subsetDataset(DatasetHandle d, std::vector<size_t> indices);
+
+// A finite pass over a dataset, see Dataset::iterate().
+struct DatasetIterator {
+    // The next item, or nothing at the end. Rethrows errors of the workers.
+    virtual std::optional<Item> next() = 0;
+    virtual size_t size() = 0;
+    virtual ~DatasetIterator() = default;
+};
+using DatasetIteratorHandle = std::shared_ptr<DatasetIterator>;
+
+DatasetIteratorHandle iterateDataset(DatasetHandle d, size_t nThreads,
+                                     bool ordered, bool shardAware);
 
 // Dataset interface:
 struct Dataset : public std::enable_shared_from_this<Dataset> {
    public:
     // The list of keys must be sorted in a Dataset.
     KeyList keys{};
+    // The keys of the dataset. Wrappers that do not change the keys forward
+    // them from their base instead of holding a copy.
+    virtual KeyList const& keyList() { return keys; }
 
     virtual size_t size() { return keys.size(); }
 
@@ -30,6 +54,39 @@ struct Dataset : public std::enable_shared_from_this<Dataset> {
     virtual Item getItem(size_t idx) { return (*this)[keys[idx]]; }
     virtual std::string_view getKey(size_t idx) { return keys[idx]; }
 
+    // Shared, immutable views of items. Datasets holding items in memory
+    // override these to avoid deep copies, others wrap a fresh item. Shared
+    // items may also hold their key in "key", samplers then pass them on
+    // without copying (see Sampler::sampleShared).
+    virtual SharedItem sharedItem(std::string_view key) {
+        return SharedItem((*this)[key]);
+    }
+    virtual SharedItem getSharedItem(size_t idx) {
+        return SharedItem(getItem(idx));
+    }
+
+    // Metadata index: read a single field of an item without loading it.
+    // Returns std::nullopt if this dataset has no index for the field, or the
+    // item does not have the field.
+    virtual std::optional<ValueType> metadata(std::string_view key,
+                                              std::string_view field) {
+        return std::nullopt;
+    }
+
+    // The partition holding each item, e.g. the shard of a union of shards.
+    // Empty if the dataset is not partitioned.
+    virtual std::vector<int> partitions() { return {}; }
+
+    // Evaluate a predicate on all items, returns a bitmap over keys. The field
+    // "key" holds the key of the item, as in sample(). FieldPredicates are
+    // answered from the metadata index when possible, otherwise the items are
+    // loaded.
+    std::vector<bool> select(ItemPredicateHandle pred);
+
+    // The sub-dataset of items passing the predicate, see select(). Throws if
+    // no item passes.
+    DatasetHandle where(ItemPredicateHandle pred);
+
     // Apply a transform to all the items in the Dataset.
     // The transform is lazy, only applied when operator[] is called.
     DatasetHandle map(ItemTransformHandle func) {
@@ -63,15 +120,46 @@ struct Dataset : public std::enable_shared_from_this<Dataset> {
     SamplerHandle permuteSample() {
         return permuteSampleDataset(shared_from_this());
     }
+    // Permuted sampling for rank of a distributed job of worldSize ranks.
+    // Ranks built with the same seed draw disjoint items, reshuffled every
+    // epoch, the same number of items per rank. With weightKey, e.g. the
+    // item count of shards, ranks are also balanced by total weight.
+    SamplerHandle distributedPermuteSample(size_t rank, size_t worldSize,
+                                           uint64_t seed,
+                                           std::string weightKey) {
+        return distributedPermuteSampleDataset(shared_from_this(), rank,
+                                               worldSize, seed,
+                                               std::move(weightKey));
+    }
+
+    // Iterate over all items once, loading them with nThreads workers. Items
+    // hold their key in "key", as in sample(). Items are visited in key
+    // order, or partition by partition with shardAware (see partitions()).
+    // With ordered, they are returned in that order, otherwise as they
+    // complete.
+    DatasetIteratorHandle iterate(size_t nThreads, bool ordered,
+                                  bool shardAware) {
+        return iterateDataset(shared_from_this(), nThreads, ordered,
+                              shardAware);
+    }
 
     // Save all items in a dataset to a map. This can be slow.
     ItemDict toMap() {
         ItemDict key_items;
-        for (auto&& key : keys) {
+        for (auto&& key : keyList()) {
             key_items.emplace_hint(key_items.end(), key, (*this)[key]);
         }
         return key_items;
     }
+
+    // Instrumentation, see Sampler::stats().
+    virtual StageStatsHandle stageStats() { return nullptr; }
+    virtual Gauges gauges() { return {}; }
+    StatsReport stats() {
+        if (auto st = stageStats()) return st->report();
+        return StatsReport{.values = gauges()};
+    }
+
     virtual ~Dataset() = default;
 
    protected:
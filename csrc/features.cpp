@@ -0,0 +1,330 @@
+#include "features.h"
+
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "audio.h"
+
+namespace data {
+
+namespace {
+double hzToMel(double f, bool slaney) {
+    if (not slaney) return 2595.0 * std::log10(1.0 + f / 700.0);
+    constexpr double fSp = 200.0 / 3, minLogHz = 1000.0;
+    double minLogMel = minLogHz / fSp, logStep = std::log(6.4) / 27.0;
+    if (f < minLogHz) return f / fSp;
+    return minLogMel + std::log(f / minLogHz) / logStep;
+}
+
+double melToHz(double m, bool slaney) {
+    if (not slaney) return 700.0 * (std::pow(10.0, m / 2595.0) - 1.0);
+    constexpr double fSp = 200.0 / 3, minLogHz = 1000.0;
+    double minLogMel = minLogHz / fSp, logStep = std::log(6.4) / 27.0;
+    if (m < minLogMel) return m * fSp;
+    return minLogHz * std::exp(logStep * (m - minLogMel));
+}
+
+MelSpec resolved(MelSpec spec) {
+    if (spec.winLength == 0) spec.winLength = spec.nFft;
+    if (spec.hopLength == 0) spec.hopLength = spec.winLength / 2;
+    if (spec.fMax == 0) spec.fMax = spec.sampleRate / 2;
+    if (spec.nFft <= 0 or spec.hopLength <= 0 or spec.nMels <= 0 or
+        spec.winLength > spec.nFft) {
+        throw std::runtime_error("Invalid mel spectrogram spec.");
+    }
+    if (spec.melScale != "htk" and spec.melScale != "slaney") {
+        throw std::runtime_error("Unknown mel scale: " + spec.melScale);
+    }
+    if (not spec.norm.empty() and spec.norm != "slaney") {
+        throw std::runtime_error("Unknown mel norm: " + spec.norm);
+    }
+    return spec;
+}
+
+void checkSampleRate(char const* name, double sr, double expected) {
+    if (sr != expected) {
+        throw std::runtime_error(std::string(name) + " got a sample rate of " +
+                                 std::to_string(sr) + ", expected " +
+                                 std::to_string(expected));
+    }
+}
+
+// Pad for the same framing as torch::stft with center: frame t starts at
+// sample t * hopLength of the padded wave.
+Tensor centerPad(Tensor x, int64_t frameLength) {
+    auto left = frameLength / 2, right = frameLength - left;
+    auto opts = torch::nn::functional::PadFuncOptions({left, right});
+    if (x.size(0) > right) opts.mode(torch::kReflect);
+    return torch::nn::functional::pad(x.view({1, 1, -1}), opts).view(-1);
+}
+
+// Running sums of squares, sums[i] is the energy of x[0, i).
+void squareSums(Tensor const& x, std::vector<double>& sums) {
+    auto n = x.size(0);
+    auto px = x.data_ptr<float>();
+    sums.resize(n + 1);
+    sums[0] = 0;
+    for (int64_t i = 0; i < n; ++i) {
+        sums[i + 1] = sums[i] + static_cast<double>(px[i]) * px[i];
+    }
+}
+}  // namespace
+
+Tensor monoFloat32(Tensor wave) {
+    if (wave.scalar_type() == torch::kInt16 or
+        wave.scalar_type() == torch::kInt32) {
+        wave = pcmToFloat32(wave);
+    } else {
+        wave = wave.to(torch::kFloat32);
+    }
+    if (wave.dim() == 2) {
+        wave = wave.size(1) == 1 ? wave.select(1, 0) : wave.mean(1);
+    }
+    return wave.contiguous();
+}
+
+// As torchaudio.functional.melscale_fbanks, keeping the non-zero band of
+// each triangle only.
+MelSpectrogram::MelSpectrogram(MelSpec spec)
+    : s{resolved(std::move(spec))},
+      window{torch::hann_window(s.winLength, torch::kFloat32)} {
+    bool slaney = s.melScale == "slaney";
+    auto nFreq = s.nFft / 2 + 1;
+    double top = std::floor(s.sampleRate / 2);
+    std::vector<double> freqs(nFreq);
+    for (int64_t k = 0; k < nFreq; ++k) {
+        freqs[k] = nFreq == 1 ? 0.0 : top * k / (nFreq - 1);
+    }
+    auto mMin = hzToMel(s.fMin, slaney), mMax = hzToMel(s.fMax, slaney);
+    std::vector<double> points(s.nMels + 2);
+    for (int64_t i = 0; i < s.nMels + 2; ++i) {
+        points[i] = melToHz(mMin + (mMax - mMin) * i / (s.nMels + 1), slaney);
+    }
+    first.resize(s.nMels);
+    weights.resize(s.nMels);
+    for (int64_t m = 0; m < s.nMels; ++m) {
+        double lo = points[m], mid = points[m + 1], hi = points[m + 2];
+        double scale = s.norm == "slaney" ? 2.0 / (hi - lo) : 1.0;
+        first[m] = 0;
+        for (int64_t k = 0; k < nFreq; ++k) {
+            double down = (freqs[k] - lo) / (mid - lo);
+            double up = (hi - freqs[k]) / (hi - mid);
+            double w = std::max(0.0, std::min(down, up));
+            if (w <= 0) {
+                if (weights[m].empty()) first[m] = k + 1;
+                continue;
+            }
+            // Bins between non-zero weights are zero only at the peak.
+            weights[m].resize(k - first[m], 0.0f);
+            weights[m].push_back(static_cast<float>(w * scale));
+        }
+    }
+}
+
+Tensor MelSpectrogram::operator()(Tensor wave) const {
+    auto x = monoFloat32(wave);
+    auto n = x.size(0);
+    auto mode = n > s.nFft / 2 ? "reflect" : "constant";
+    // stft pads the signal itself with center, frames are batched in one
+    // call: [nFreq, frames].
+    auto spec = torch::stft(x, s.nFft, s.hopLength, s.winLength, window,
+                            /*center=*/true, mode, /*normalized=*/false,
+                            /*onesided=*/true, /*return_complex=*/true);
+    Tensor p;
+    if (s.power == 2) {
+        p = torch::view_as_real(spec).pow(2).sum(-1);
+    } else {
+        p = spec.abs();
+        if (s.power != 1) p = p.pow(s.power);
+    }
+    p = p.contiguous();
+    auto frames = p.size(1);
+    auto mel = torch::zeros({s.nMels, frames}, torch::kFloat32);
+    auto pp = p.data_ptr<float>();
+    auto pm = mel.data_ptr<float>();
+    // Rows of bins are contiguous over frames, so each weight is an axpy.
+    for (int64_t m = 0; m < s.nMels; ++m) {
+        auto out = pm + m * frames;
+        for (size_t k = 0; k < weights[m].size(); ++k) {
+            auto w = weights[m][k];
+            auto in = pp + (first[m] + static_cast<int64_t>(k)) * frames;
+            for (int64_t t = 0; t < frames; ++t) out[t] += w * in[t];
+        }
+    }
+    if (s.logEps > 0) mel = mel.clamp_min_(s.logEps).log_();
+    return mel.t().contiguous();
+}
+
+struct MelSpectrogramTransform final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    std::string melKey;
+    std::string nFrameKey;
+    MelSpectrogram mel;
+
+    MelSpectrogramTransform(std::string waveKey, std::string srKey,
+                            std::string melKey, std::string nFrameKey,
+                            MelSpec spec)
+        : waveKey{waveKey},
+          srKey{srKey},
+          melKey{melKey},
+          nFrameKey{nFrameKey},
+          mel{std::move(spec)} {}
+
+    Item operator()(Item item) override {
+        checkSampleRate("melSpectrogramTransform",
+                        std::get<double>(resolve(item[srKey])),
+                        mel.spec().sampleRate);
+        auto m = mel(std::get<Tensor>(resolve(item[waveKey])));
+        item[nFrameKey] = m.size(0);
+        item[melKey] = m;
+        return item;
+    }
+};
+
+ItemTransformHandle melSpectrogramTransform(std::string waveKey,
+                                            std::string srKey,
+                                            std::string melKey,
+                                            std::string nFrameKey,
+                                            MelSpec spec) {
+    return std::make_shared<MelSpectrogramTransform>(
+        waveKey, srKey, melKey, nFrameKey, std::move(spec));
+}
+
+// YIN, de Cheveigné and Kawahara 2002, with the difference function of lag
+// tau over the first half of each frame:
+//   d(tau) = e(0) + e(tau) - 2 r(tau),
+// where e(tau) is the energy of x[tau, tau + W) and r(tau) the correlation of
+// x[0, W) with x[tau, tau + W).
+Tensor estimatePitch(Tensor wave, PitchSpec const& spec) {
+    auto len = spec.frameLength, hop = spec.hopLength, W = len / 2;
+    auto tauMax = std::min<int64_t>(
+        len - W, static_cast<int64_t>(std::ceil(spec.sampleRate / spec.fMin)));
+    auto tauMin = std::max<int64_t>(
+        2, static_cast<int64_t>(std::floor(spec.sampleRate / spec.fMax)));
+    if (hop <= 0 or tauMin + 1 >= tauMax) {
+        throw std::runtime_error("Invalid pitch spec.");
+    }
+    auto x = centerPad(monoFloat32(wave), len);
+    auto frames = x.unfold(0, len, hop);
+    auto nFrame = frames.size(0);
+    // Lags stay within the frame, so an FFT of len points or more does not
+    // wrap around.
+    int64_t nFft = 1;
+    while (nFft < len) nFft *= 2;
+    auto spectrum = torch::fft::rfft(frames, nFft, -1);
+    auto head = torch::fft::rfft(frames.narrow(1, 0, W), nFft, -1);
+    auto r = torch::fft::irfft(head.conj() * spectrum, nFft, -1)
+                 .narrow(1, 0, tauMax + 1)
+                 .contiguous();
+
+    // Scratch reused by the calls of each thread.
+    thread_local std::vector<double> sums;
+    thread_local std::vector<double> cmnd;
+    squareSums(x, sums);
+    cmnd.resize(tauMax + 1);
+
+    auto f0 = torch::zeros({nFrame}, torch::kFloat32);
+    auto pf = f0.data_ptr<float>();
+    auto pr = r.data_ptr<float>();
+    for (int64_t t = 0; t < nFrame; ++t) {
+        auto e = sums.data() + t * hop;
+        auto rt = pr + t * (tauMax + 1);
+        double e0 = e[W] - e[0];
+        // Digital silence, below -100 dBFS.
+        if (e0 < W * 1e-10) continue;
+        // Cumulative mean normalized difference.
+        double total = 0;
+        cmnd[0] = 1;
+        for (int64_t tau = 1; tau <= tauMax; ++tau) {
+            auto d = std::max(0.0, e0 + (e[tau + W] - e[tau]) - 2.0 * rt[tau]);
+            total += d;
+            cmnd[tau] = total > 0 ? d * tau / total : 1.0;
+        }
+        // The first dip below the threshold, down to its local minimum.
+        int64_t best = 0;
+        for (int64_t tau = tauMin; tau < tauMax; ++tau) {
+            if (cmnd[tau] >= spec.threshold) continue;
+            while (tau + 1 < tauMax and cmnd[tau + 1] < cmnd[tau]) ++tau;
+            best = tau;
+            break;
+        }
+        if (best == 0) continue;
+        // Parabolic interpolation of the minimum.
+        double a = cmnd[best - 1], b = cmnd[best], c = cmnd[best + 1];
+        double curve = a - 2 * b + c;
+        double shift = curve > 0 ? 0.5 * (a - c) / curve : 0.0;
+        pf[t] = static_cast<float>(spec.sampleRate / (best + shift));
+    }
+    return f0;
+}
+
+Tensor frameEnergy(Tensor wave, EnergySpec const& spec) {
+    auto len = spec.frameLength, hop = spec.hopLength;
+    if (len <= 0 or hop <= 0) {
+        throw std::runtime_error("Invalid energy spec.");
+    }
+    auto x = centerPad(monoFloat32(wave), len);
+    thread_local std::vector<double> sums;
+    squareSums(x, sums);
+    auto nFrame = (x.size(0) - len) / hop + 1;
+    auto energy = torch::empty({nFrame}, torch::kFloat32);
+    auto pe = energy.data_ptr<float>();
+    for (int64_t t = 0; t < nFrame; ++t) {
+        auto rms = std::sqrt((sums[t * hop + len] - sums[t * hop]) / len);
+        if (spec.logEps > 0) rms = std::log(std::max(rms, spec.logEps));
+        pe[t] = static_cast<float>(rms);
+    }
+    return energy;
+}
+
+struct PitchTransform final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    std::string f0Key;
+    PitchSpec spec;
+
+    PitchTransform(std::string waveKey, std::string srKey, std::string f0Key,
+                   PitchSpec spec)
+        : waveKey{waveKey}, srKey{srKey}, f0Key{f0Key}, spec{spec} {}
+
+    Item operator()(Item item) override {
+        checkSampleRate("pitchTransform",
+                        std::get<double>(resolve(item[srKey])),
+                        spec.sampleRate);
+        item[f0Key] =
+            estimatePitch(std::get<Tensor>(resolve(item[waveKey])), spec);
+        return item;
+    }
+};
+
+ItemTransformHandle pitchTransform(std::string waveKey, std::string srKey,
+                                   std::string f0Key, PitchSpec spec) {
+    return std::make_shared<PitchTransform>(waveKey, srKey, f0Key, spec);
+}
+
+struct EnergyTransform final : public ItemTransform {
+    std::string waveKey;
+    std::string energyKey;
+    EnergySpec spec;
+
+    EnergyTransform(std::string waveKey, std::string energyKey,
+                    EnergySpec spec)
+        : waveKey{waveKey}, energyKey{energyKey}, spec{spec} {}
+
+    Item operator()(Item item) override {
+        item[energyKey] =
+            frameEnergy(std::get<Tensor>(resolve(item[waveKey])), spec);
+        return item;
+    }
+};
+
+ItemTransformHandle energyTransform(std::string waveKey, std::string energyKey,
+                                    EnergySpec spec) {
+    return std::make_shared<EnergyTransform>(waveKey, energyKey, spec);
+}
+
+}  // namespace data
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+/*
+Acoustic features computed in the loader threads, so that the training step
+does not spend device time on them. Waves are [nSample, nChannel], int16 or
+int32 PCM or float, channels are averaged. Frames follow torchaudio with
+center=True: frame t is centered on sample t * hopLength, the wave is
+reflect-padded by nFft / 2, and there are nSample / hopLength + 1 frames.
+*/
+
+namespace data {
+
+// Defaults match torchaudio.transforms.MelSpectrogram, with a log on top.
+struct MelSpec {
+    double sampleRate{16000};
+    int64_t nFft{400};
+    // 0 for nFft.
+    int64_t winLength{0};
+    // 0 for winLength / 2.
+    int64_t hopLength{0};
+    int64_t nMels{128};
+    double fMin{0};
+    // 0 for sampleRate / 2.
+    double fMax{0};
+    // 1 for magnitude, 2 for power.
+    double power{2};
+    // "htk" or "slaney" mel scale, and "slaney" area normalization or none.
+    std::string melScale{"htk"};
+    std::string norm{};
+    // Output log(max(mel, logEps)), or the linear mel if logEps is 0.
+    double logEps{1e-5};
+};
+
+// A Hann window and a mel filterbank kept as one band of FFT bins per mel,
+// built once and shared by all threads.
+class MelSpectrogram {
+   public:
+    explicit MelSpectrogram(MelSpec spec);
+    // Returns FloatTensor[frames, nMels].
+    Tensor operator()(Tensor wave) const;
+    MelSpec const& spec() const { return s; }
+
+   private:
+    MelSpec s;
+    Tensor window;
+    // Mel m weights bins [first[m], first[m] + weights[m].size()).
+    std::vector<int64_t> first;
+    std::vector<std::vector<float>> weights;
+};
+
+// Mono float32 wave [nSample] from a wave [nSample, nChannel].
+Tensor monoFloat32(Tensor wave);
+
+// Compute the mel spectrogram of waveKey into melKey, and its number of
+// frames into nFrameKey. Throws if srKey does not match spec.sampleRate.
+ItemTransformHandle melSpectrogramTransform(std::string waveKey,
+                                            std::string srKey,
+                                            std::string melKey,
+                                            std::string nFrameKey,
+                                            MelSpec spec);
+
+// YIN pitch tracking. The default hop matches MelSpec's, so that pitch frames
+// line up with mel frames.
+struct PitchSpec {
+    double sampleRate{16000};
+    // Frames hold frameLength samples, half of them being the integration
+    // window and half the lags.
+    int64_t frameLength{1024};
+    int64_t hopLength{200};
+    double fMin{50};
+    double fMax{1000};
+    // Frames whose cumulative mean normalized difference stays above the
+    // threshold are unvoiced.
+    double threshold{0.1};
+};
+
+// Returns the fundamental frequency in Hz, FloatTensor[frames], 0 for
+// unvoiced frames. Autocorrelations of all frames are batched in one FFT.
+Tensor estimatePitch(Tensor wave, PitchSpec const& spec);
+
+// Root mean square of rectangular frames, or its log. The defaults match
+// MelSpec's.
+struct EnergySpec {
+    int64_t frameLength{400};
+    int64_t hopLength{200};
+    // Output log(max(rms, logEps)), or the linear rms if logEps is 0.
+    double logEps{0};
+};
+
+// Returns FloatTensor[frames].
+Tensor frameEnergy(Tensor wave, EnergySpec const& spec);
+
+// Estimate the pitch of waveKey into f0Key. Throws if srKey does not match
+// spec.sampleRate.
+ItemTransformHandle pitchTransform(std::string waveKey, std::string srKey,
+                                   std::string f0Key, PitchSpec spec);
+
+// Compute the frame energy of waveKey into energyKey.
+ItemTransformHandle energyTransform(std::string waveKey, std::string energyKey,
+                                    EnergySpec spec);
+
+}  // namespace data
@@ -1,20 +1,23 @@
 #include "functional.h"
 
+#include <algorithm>
 #include <fstream>
 #include <memory>
+#include <regex>
 
+#include "item.h"
 #include "types.h"
 
 namespace data {
-struct Roll final : ItemTransform {
-    std::string key;
+struct Roll final : FieldTransform<Roll> {
+    ItemField key;
     int dim{};
     int shift{};
     Roll(std::string key, int dim, int shift)
         : key{key}, dim{dim}, shift{shift} {}
-    Item operator()(Item item) override {
-        Tensor t = std::get<Tensor>(item[key]);
-        item[key] = torch::roll(t, {shift}, {dim});
+    template <typename ItemT> ItemT transform(ItemT item) {
+        Tensor t = std::get<Tensor>(field(item, key));
+        field(item, key) = torch::roll(t, {shift}, {dim});
         return item;
     }
 };
@@ -23,20 +26,20 @@ ItemTransformHandle roll(std::string key, int dim, int shift) {
     return std::make_shared<Roll>(key, dim, shift);
 }
 
-struct RandomRoll final : ItemTransform {
-    std::string key;
+struct RandomRoll final : FieldTransform<RandomRoll> {
+    ItemField key;
     int dim;
     int shiftMin;
     int shiftMax;
     RandomRoll(std::string key, int dim, int shiftMin, int shiftMax)
         : key{key}, dim{dim}, shiftMin{shiftMin}, shiftMax{shiftMax} {}
-    Item operator()(Item item) override {
+    template <typename ItemT> ItemT transform(ItemT item) {
         static thread_local auto rng = std::mt19937(std::random_device()());
 
-        Tensor t = std::get<Tensor>(item[key]);
+        Tensor t = std::get<Tensor>(field(item, key));
         auto dist = std::uniform_int_distribution<int>(shiftMin, shiftMax);
         auto shift = dist(rng);
-        item[key] = torch::roll(t, {shift}, {dim});
+        field(item, key) = torch::roll(t, {shift}, {dim});
         return item;
     }
 };
@@ -46,9 +49,9 @@ ItemTransformHandle randomRoll(std::string key, int dim, int shiftMin,
     return std::make_shared<RandomRoll>(key, dim, shiftMin, shiftMax);
 }
 
-struct RightPadSequenceFrame final : ItemTransform {
-    std::string key;
-    std::string frameKey;
+struct RightPadSequenceFrame final : FieldTransform<RightPadSequenceFrame> {
+    ItemField key;
+    ItemField frameKey;
     int dim;
     int frameSize;
 
@@ -56,12 +59,12 @@ struct RightPadSequenceFrame final : ItemTransform {
                           int frameSize)
         : key{key}, frameKey{frameKey}, dim{dim}, frameSize{frameSize} {}
 
-    Item operator()(Item item) override {
-        Tensor t = std::get<Tensor>(item[key]);
+    template <typename ItemT> ItemT transform(ItemT item) {
+        Tensor t = std::get<Tensor>(field(item, key));
         int n = t.size(dim);
         int m = (n + frameSize - 1) / frameSize;
         int n_pad = m * frameSize - n;
-        item[frameKey] = m;
+        field(item, frameKey) = m;
         if (n_pad == 0) {
             return item;
         }
@@ -70,7 +73,7 @@ struct RightPadSequenceFrame final : ItemTransform {
         nsz[dim] = n_pad;
         auto p =
             t.new_zeros(torch::IntArrayRef(nsz.data(), nsz.data() + sz.size()));
-        item[key] = torch::cat({t, p}, dim);
+        field(item, key) = torch::cat({t, p}, dim);
         return item;
     }
 };
@@ -81,21 +84,22 @@ ItemTransformHandle rightPadSequenceFrame(std::string key, std::string frameKey,
                                                    frameSize);
 }
 
-struct RightTruncateSequenceFrame final : ItemTransform {
-    std::string key;
-    std::string frameKey;
+struct RightTruncateSequenceFrame final
+    : FieldTransform<RightTruncateSequenceFrame> {
+    ItemField key;
+    ItemField frameKey;
     int dim;
     int frameSize;
     RightTruncateSequenceFrame(std::string key, std::string frameKey, int dim,
                                int frameSize)
         : key{key}, frameKey{frameKey}, dim{dim}, frameSize{frameSize} {}
-    Item operator()(Item item) override {
-        Tensor t = std::get<Tensor>(item[key]);
+    template <typename ItemT> ItemT transform(ItemT item) {
+        Tensor t = std::get<Tensor>(field(item, key));
         int n = t.size(dim);
         int m = n / frameSize;
         int nTrunc = m * frameSize;
-        item[key] = t.slice(dim, 0, nTrunc);
-        item[frameKey] = m;
+        field(item, key) = t.slice(dim, 0, nTrunc);
+        field(item, frameKey) = m;
         return item;
     }
 };
@@ -107,18 +111,18 @@ ItemTransformHandle rightTruncateSequenceFrame(std::string key,
                                                         frameSize);
 }
 
-struct AddInt64 final : ItemTransform {
-    std::string keyA;
-    std::string keyB;
-    std::string keyC;
+struct AddInt64 final : FieldTransform<AddInt64> {
+    ItemField keyA;
+    ItemField keyB;
+    ItemField keyC;
     int64_t bias{0};
     AddInt64(std::string keyA, std::string keyB, std::string key_c,
              int64_t bias)
         : keyA(keyA), keyB(keyB), keyC(key_c), bias(bias) {}
-    Item operator()(Item item) override {
-        auto a = std::get<int64_t>(item[keyA]);
-        auto b = std::get<int64_t>(item[keyB]);
-        item[keyC] = a + b + bias;
+    template <typename ItemT> ItemT transform(ItemT item) {
+        auto a = std::get<int64_t>(field(item, keyA));
+        auto b = std::get<int64_t>(field(item, keyB));
+        field(item, keyC) = a + b + bias;
         return item;
     }
 };
@@ -151,23 +155,145 @@ ItemTransformHandle readFile(std::string pathKey, std::string textKey) {
     return std::make_shared<ReadFile>(pathKey, textKey);
 }
 
-struct TotalLength final : ItemTransform {
-    Item operator()(Item item) override {
-        auto n_phone = std::get<int64_t>(item["n_phone"]);
-        auto n_frame = std::get<int64_t>(item["n_frame"]);
-        item["n_total"] = n_phone + 2 * n_frame;
+struct IntRange final : FieldPredicate {
+    int64_t lo;
+    int64_t hi;
+    IntRange(std::string key, int64_t lo, int64_t hi)
+        : FieldPredicate{std::move(key)}, lo{lo}, hi{hi} {}
+    bool test(ValueType const& value) override {
+        auto p = std::get_if<int64_t>(&value);
+        return p != nullptr and lo <= *p and *p < hi;
+    }
+};
+
+ItemPredicateHandle intRange(std::string key, int64_t lo, int64_t hi) {
+    return std::make_shared<IntRange>(std::move(key), lo, hi);
+}
+
+struct IntIn final : FieldPredicate {
+    std::vector<int64_t> values;
+    IntIn(std::string key, std::vector<int64_t> values)
+        : FieldPredicate{std::move(key)}, values{std::move(values)} {
+        std::sort(this->values.begin(), this->values.end());
+    }
+    bool test(ValueType const& value) override {
+        auto p = std::get_if<int64_t>(&value);
+        return p != nullptr and
+               std::binary_search(values.begin(), values.end(), *p);
+    }
+};
+
+ItemPredicateHandle intIn(std::string key, std::vector<int64_t> values) {
+    return std::make_shared<IntIn>(std::move(key), std::move(values));
+}
+
+struct StringIn final : FieldPredicate {
+    StringList values;
+    StringIn(std::string key, StringList values)
+        : FieldPredicate{std::move(key)}, values{std::move(values)} {
+        std::sort(this->values.begin(), this->values.end());
+    }
+    bool test(ValueType const& value) override {
+        auto p = std::get_if<std::string>(&value);
+        return p != nullptr and
+               std::binary_search(values.begin(), values.end(), *p);
+    }
+};
+
+ItemPredicateHandle stringIn(std::string key, StringList values) {
+    return std::make_shared<StringIn>(std::move(key), std::move(values));
+}
+
+struct StringPrefix final : FieldPredicate {
+    std::string prefix;
+    StringPrefix(std::string key, std::string prefix)
+        : FieldPredicate{std::move(key)}, prefix{std::move(prefix)} {}
+    bool test(ValueType const& value) override {
+        auto p = std::get_if<std::string>(&value);
+        return p != nullptr and p->starts_with(prefix);
+    }
+};
+
+ItemPredicateHandle stringPrefix(std::string key, std::string prefix) {
+    return std::make_shared<StringPrefix>(std::move(key), std::move(prefix));
+}
+
+struct StringRegex final : FieldPredicate {
+    std::regex pattern;
+    StringRegex(std::string key, std::string const& pattern)
+        : FieldPredicate{std::move(key)}, pattern{pattern} {}
+    bool test(ValueType const& value) override {
+        auto p = std::get_if<std::string>(&value);
+        return p != nullptr and std::regex_search(*p, pattern);
+    }
+};
+
+ItemPredicateHandle stringRegex(std::string key, std::string pattern) {
+    return std::make_shared<StringRegex>(std::move(key), pattern);
+}
+
+struct KeyPrefix final : KeyPredicate {
+    std::string prefix;
+    explicit KeyPrefix(std::string prefix) : prefix{std::move(prefix)} {}
+    bool operator()(std::string_view sv) override {
+        return sv.starts_with(prefix);
+    }
+};
+
+KeyPredicateHandle keyPrefix(std::string prefix) {
+    return std::make_shared<KeyPrefix>(std::move(prefix));
+}
+
+struct KeyRegex final : KeyPredicate {
+    std::regex pattern;
+    explicit KeyRegex(std::string const& pattern) : pattern{pattern} {}
+    bool operator()(std::string_view sv) override {
+        return std::regex_search(sv.begin(), sv.end(), pattern);
+    }
+};
+
+KeyPredicateHandle keyRegex(std::string pattern) {
+    return std::make_shared<KeyRegex>(pattern);
+}
+
+struct KeyIn final : KeyPredicate {
+    KeyList keys;
+    explicit KeyIn(KeyList keys) : keys{std::move(keys)} {
+        std::sort(this->keys.begin(), this->keys.end());
+    }
+    bool operator()(std::string_view sv) override {
+        return std::binary_search(keys.begin(), keys.end(), sv);
+    }
+};
+
+KeyPredicateHandle keyIn(KeyList keys) {
+    return std::make_shared<KeyIn>(std::move(keys));
+}
+
+struct TotalLength final : FieldTransform<TotalLength> {
+    ItemField nPhone{"n_phone"};
+    ItemField nFrame{"n_frame"};
+    ItemField nTotal{"n_total"};
+    template <typename ItemT> ItemT transform(ItemT item) {
+        auto n_phone = std::get<int64_t>(field(item, nPhone));
+        auto n_frame = std::get<int64_t>(field(item, nFrame));
+        field(item, nTotal) = n_phone + 2 * n_frame;
         return item;
     }
 };
 
 ItemTransformHandle addTotalLength() { return std::make_shared<TotalLength>(); }
 
-struct TotalLengthWithRef final : ItemTransform {
-    Item operator()(Item item) override {
-        auto n_phone = std::get<int64_t>(item["n_phone"]);
-        auto n_frame = std::get<int64_t>(item["n_frame"]);
-        auto n_frame_ref = std::get<int64_t>(item["n_frame_ref"]);
-        item["n_total"] = n_phone + 2 * n_frame + n_frame_ref;
+struct TotalLengthWithRef final : FieldTransform<TotalLengthWithRef> {
+    ItemField nPhone{"n_phone"};
+    ItemField nFrame{"n_frame"};
+    ItemField nFrameRef{"n_frame_ref"};
+    ItemField nTotal{"n_total"};
+    template <typename ItemT> ItemT transform(ItemT item) {
+        auto n_phone = std::get<int64_t>(field(item, nPhone));
+        auto n_frame = std::get<int64_t>(field(item, nFrame));
+        auto n_frame_ref = std::get<int64_t>(field(item, nFrameRef));
+        field(item, nTotal) = n_phone + 2 * n_frame + n_frame_ref;
         return item;
     }
 };
@@ -19,6 +19,19 @@ ItemTransformHandle rightTruncateSequenceFrame(std::string key,
 ItemTransformHandle addInt64(std::string keyA, std::string keyB,
                              std::string keyC, int64_t bias);
 ItemTransformHandle readFile(std::string pathKey, std::string textKey);
+
+// Native predicates. Field predicates can be pushed down into datasets with
+// metadata indexes, see Dataset::select.
+// Passes if lo <= item[key] < hi.
+ItemPredicateHandle intRange(std::string key, int64_t lo, int64_t hi);
+ItemPredicateHandle intIn(std::string key, std::vector<int64_t> values);
+ItemPredicateHandle stringIn(std::string key, StringList values);
+ItemPredicateHandle stringPrefix(std::string key, std::string prefix);
+ItemPredicateHandle stringRegex(std::string key, std::string pattern);
+KeyPredicateHandle keyPrefix(std::string prefix);
+KeyPredicateHandle keyRegex(std::string pattern);
+KeyPredicateHandle keyIn(KeyList keys);
+
 // HACK this is for AR training
 ItemTransformHandle addTotalLength();
 ItemTransformHandle addTotalLengthWithRef();
@@ -0,0 +1,108 @@
+#include "item.h"
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+
+#include "types.h"
+
+namespace data {
+
+namespace {
+struct FieldRegistry {
+    std::shared_mutex lock;
+    std::map<std::string, FieldID, std::less<>> ids;
+    // std::deque keeps references to names stable on growth.
+    std::deque<std::string> names;
+};
+
+FieldRegistry& registry() {
+    static FieldRegistry r;
+    return r;
+}
+}  // namespace
+
+FieldID fieldID(std::string_view name) {
+    auto& r = registry();
+    {
+        std::shared_lock guard(r.lock);
+        auto it = r.ids.find(name);
+        if (it != r.ids.end()) return it->second;
+    }
+    std::unique_lock guard(r.lock);
+    auto it = r.ids.find(name);
+    if (it != r.ids.end()) return it->second;
+    auto id = static_cast<FieldID>(r.names.size());
+    r.names.emplace_back(name);
+    r.ids.emplace(r.names.back(), id);
+    return id;
+}
+
+std::string const& fieldName(FieldID id) {
+    auto& r = registry();
+    std::shared_lock guard(r.lock);
+    if (id >= r.names.size()) {
+        throw std::out_of_range("Unknown FieldID");
+    }
+    return r.names[id];
+}
+
+FlatItem::FlatItem(Item const& item) {
+    fields.reserve(item.size());
+    for (auto const& [k, v] : item) {
+        fields.emplace_back(fieldID(k), v);
+    }
+}
+
+FlatItem::FlatItem(Item&& item) {
+    fields.reserve(item.size());
+    for (auto& [k, v] : item) {
+        fields.emplace_back(fieldID(k), std::move(v));
+    }
+}
+
+ValueType& FlatItem::at(FieldID id) {
+    if (auto p = find(id)) return *p;
+    throw std::out_of_range("Field not found in FlatItem: " + fieldName(id));
+}
+
+ValueType const& FlatItem::at(FieldID id) const {
+    if (auto p = find(id)) return *p;
+    throw std::out_of_range("Field not found in FlatItem: " + fieldName(id));
+}
+
+bool FlatItem::erase(FieldID id) {
+    for (auto it = fields.begin(); it != fields.end(); ++it) {
+        if (it->first == id) {
+            fields.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+Item FlatItem::toItem() const& {
+    Item item;
+    for (auto const& [k, v] : fields) {
+        item.insert_or_assign(fieldName(k), v);
+    }
+    return item;
+}
+
+Item FlatItem::toItem() && {
+    Item item;
+    for (auto& [k, v] : fields) {
+        item.insert_or_assign(fieldName(k), std::move(v));
+    }
+    fields.clear();
+    return item;
+}
+
+// Fallback for transforms that only implement the Item interface.
+FlatItem ItemTransform::apply(FlatItem item) {
+    return FlatItem((*this)(std::move(item).toItem()));
+}
+
+}  // namespace data
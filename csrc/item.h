@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "types.h"
+
+namespace data {
+
+// Field names are interned into a global, append-only registry. A FieldID is
+// valid for the lifetime of the process and is shared by all threads.
+using FieldID = uint32_t;
+FieldID fieldID(std::string_view name);
+std::string const& fieldName(FieldID id);
+
+// A compact alternative to Item. Values are kept in a small flat vector of
+// (FieldID, value) pairs, so a lookup is a linear scan over integers instead
+// of a string-compare tree walk, and copying does not allocate map nodes.
+// Convert from / to Item at API boundaries.
+struct FlatItem {
+    using Field = std::pair<FieldID, ValueType>;
+    std::vector<Field> fields{};
+
+    FlatItem() = default;
+    explicit FlatItem(Item const& item);
+    explicit FlatItem(Item&& item);
+
+    [[nodiscard]] ValueType* find(FieldID id) {
+        for (auto& [k, v] : fields) {
+            if (k == id) return &v;
+        }
+        return nullptr;
+    }
+    [[nodiscard]] ValueType const* find(FieldID id) const {
+        for (auto const& [k, v] : fields) {
+            if (k == id) return &v;
+        }
+        return nullptr;
+    }
+    [[nodiscard]] bool contains(FieldID id) const {
+        return find(id) != nullptr;
+    }
+    [[nodiscard]] size_t size() const { return fields.size(); }
+
+    // Like Item::operator[], inserts a default value if the field is missing.
+    ValueType& operator[](FieldID id) {
+        if (auto p = find(id)) return *p;
+        return fields.emplace_back(id, ValueType{}).second;
+    }
+    ValueType& at(FieldID id);
+    ValueType const& at(FieldID id) const;
+    // Typed access, loading lazy values in place.
+    template <typename T> T& get(FieldID id) {
+        return std::get<T>(resolve(at(id)));
+    }
+    template <typename T> T const& get(FieldID id) const {
+        return std::get<T>(loaded(at(id)));
+    }
+
+    bool erase(FieldID id);
+
+    [[nodiscard]] Item toItem() const&;
+    [[nodiscard]] Item toItem() &&;
+};
+
+// A refcounted, immutable Item. Copies share one payload, so read-mostly
+// datasets and caches can hand out the same item to many consumers. mutate()
+// copies the payload only if it is shared (copy-on-write).
+class SharedItem {
+   public:
+    SharedItem() : p{std::make_shared<Item>()} {}
+    explicit SharedItem(Item item)
+        : p{std::make_shared<Item>(std::move(item))} {}
+
+    Item const& operator*() const { return *p; }
+    Item const* operator->() const { return p.get(); }
+    [[nodiscard]] bool unique() const { return p.use_count() == 1; }
+
+    // Get a mutable reference, detaching from other owners first.
+    Item& mutate() {
+        if (not unique()) p = std::make_shared<Item>(*p);
+        return *p;
+    }
+    // Extract the Item, moving it out if this is the only owner.
+    [[nodiscard]] Item take() && {
+        if (unique()) return std::move(*p);
+        return *p;
+    }
+
+   private:
+    std::shared_ptr<Item> p;
+};
+
+// A field name resolved once, usually when a transform or a sampler is
+// constructed. It can index both Item and FlatItem through field().
+struct ItemField {
+    std::string name{};
+    FieldID id{};
+    ItemField() = default;
+    ItemField(std::string name)
+        : name{std::move(name)}, id{fieldID(this->name)} {}
+    ItemField(std::string_view name) : ItemField(std::string(name)) {}
+    ItemField(char const* name) : ItemField(std::string(name)) {}
+};
+
+// Access a field, loading a lazy value in place.
+inline ValueType& field(Item& item, ItemField const& f) {
+    return resolve(item[f.name]);
+}
+inline ValueType& field(FlatItem& item, ItemField const& f) {
+    return resolve(item[f.id]);
+}
+
+// Base class for transforms written once for both Item and FlatItem.
+// Derived must implement `template <typename ItemT> ItemT transform(ItemT)`,
+// using field() to access values.
+template <typename Derived> struct FieldTransform : ItemTransform {
+    Item operator()(Item item) override {
+        return static_cast<Derived*>(this)->transform(std::move(item));
+    }
+    FlatItem apply(FlatItem item) override {
+        return static_cast<Derived*>(this)->transform(std::move(item));
+    }
+};
+
+}  // namespace data
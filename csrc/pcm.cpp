@@ -0,0 +1,92 @@
+#include "pcm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// Each kernel is cloned per instruction set and resolved at load time. The
+// loops are kept simple enough for the compiler to vectorize every clone.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define PCM_KERNEL \
+    __attribute__((target_clones("arch=skylake-avx512", "avx2", "default")))
+#else
+#define PCM_KERNEL
+#endif
+
+namespace data {
+
+namespace {
+// Counter based noise, so that each sample is independent of the others and
+// the loop has no carried state.
+inline uint32_t mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Triangular noise in (-1, 1), the difference of two 16 bit uniforms.
+inline float tpdf(uint32_t seed, size_t i) {
+    auto h = mix(seed ^ static_cast<uint32_t>(i));
+    return (static_cast<float>(h & 0xFFFF) - static_cast<float>(h >> 16)) *
+           (1.0f / 65536.0f);
+}
+
+uint32_t ditherSeed() {
+    static std::atomic<uint32_t> counter{0};
+    return mix(counter.fetch_add(0x9E3779B9U, std::memory_order_relaxed));
+}
+
+PCM_KERNEL
+void quantize(float const* src, int32_t* dst, size_t n, unsigned bits,
+              uint32_t seed, bool dither) {
+    float scale = std::ldexp(1.0f, static_cast<int>(bits) - 1);
+    // The largest float below 2^31 for 32 bits.
+    float hi = bits < 32 ? scale - 1.0f : 2147483520.0f;
+    unsigned shift = 32 - bits;
+    for (size_t i = 0; i < n; ++i) {
+        float v = src[i] * scale + (dither ? tpdf(seed, i) : 0.0f);
+        v = std::min(std::max(v, -scale), hi);
+        auto q = static_cast<int32_t>(std::nearbyint(v));
+        dst[i] = static_cast<int32_t>(static_cast<uint32_t>(q) << shift);
+    }
+}
+}  // namespace
+
+PCM_KERNEL
+void pcm16ToFloat32(int16_t const* src, float* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = static_cast<float>(src[i]) * (1.0f / 32768.0f);
+    }
+}
+
+PCM_KERNEL
+void pcm24ToFloat32(uint8_t const* src, float* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        auto p = src + 3 * i;
+        auto v = static_cast<int32_t>(uint32_t(p[0]) << 8 |
+                                      uint32_t(p[1]) << 16 |
+                                      uint32_t(p[2]) << 24);
+        dst[i] = static_cast<float>(v) * 0x1p-31f;
+    }
+}
+
+PCM_KERNEL
+void pcm32ToFloat32(int32_t const* src, float* dst, size_t n, float scale) {
+    for (size_t i = 0; i < n; ++i) dst[i] = static_cast<float>(src[i]) * scale;
+}
+
+PCM_KERNEL
+void pcm32ToPCM16(int32_t const* src, int16_t* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] = pcm32To16(src[i]);
+}
+
+void float32ToPCM32(float const* src, int32_t* dst, size_t n, unsigned bits,
+                    bool dither) {
+    bits = std::clamp(bits, 8U, 32U);
+    quantize(src, dst, n, bits, dither ? ditherSeed() : 0, dither);
+}
+
+}  // namespace data
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/*
+Sample format conversion kernels. Samples are interleaved, n counts the
+samples of all channels. Integer formats are full scale at 2^(bits - 1), so
+the float range is [-1, 1).
+
+The kernels are plain loops. With GCC on x86-64 they are compiled for
+AVX-512, AVX2 and the baseline, and the best one for the CPU is picked when
+the library is loaded. Other targets, e.g. AArch64, compile them once and
+rely on autovectorization only, with NEON as the AArch64 baseline.
+*/
+
+namespace data {
+
+void pcm16ToFloat32(int16_t const* src, float* dst, size_t n);
+// Packed little endian 3 byte samples.
+void pcm24ToFloat32(uint8_t const* src, float* dst, size_t n);
+// Scaled by scale, 2^-31 for top-aligned samples such as sox_sample_t.
+void pcm32ToFloat32(int32_t const* src, float* dst, size_t n, float scale);
+
+// Round a top-aligned int32 sample to 16 bits, as sox does on write.
+inline int16_t pcm32To16(int32_t v) {
+    auto r = (static_cast<int64_t>(v) + 0x8000) >> 16;
+    return static_cast<int16_t>(r > INT16_MAX ? INT16_MAX : r);
+}
+void pcm32ToPCM16(int32_t const* src, int16_t* dst, size_t n);
+
+// Round to bits bits, clip, and align to the top of the int32, as sox expects
+// on write. With dither, triangular noise of one LSB is added first.
+void float32ToPCM32(float const* src, int32_t* dst, size_t n, unsigned bits,
+                    bool dither);
+
+}  // namespace data
@@ -0,0 +1,280 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+#include "dataset.h"
+#include "item.h"
+#include "sampler.h"
+#include "types.h"
+
+namespace data {
+
+namespace {
+std::atomic<bool> profiling{false};
+
+using Clock = std::chrono::steady_clock;
+
+int bucketOf(uint64_t v) {
+    using H = LatencyHistogram;
+    if (v < H::kSub) return static_cast<int>(v);
+    int msb = 63 - std::countl_zero(v);
+    int shift = msb - H::kSubBits;
+    int sub = static_cast<int>((v >> shift) & (H::kSub - 1));
+    return (shift + 1) * H::kSub + sub;
+}
+
+uint64_t lowerBoundOf(int bucket) {
+    using H = LatencyHistogram;
+    if (bucket < H::kSub) return bucket;
+    int major = bucket / H::kSub;
+    uint64_t sub = bucket % H::kSub;
+    return (H::kSub + sub) << (major - 1);
+}
+}  // namespace
+
+void setProfiling(bool enabled) { profiling = enabled; }
+bool profilingEnabled() { return profiling; }
+
+void LatencyHistogram::record(uint64_t ns) {
+    counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+    auto m = max.load(std::memory_order_relaxed);
+    while (m < ns and not max.compare_exchange_weak(m, ns)) {
+    }
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    auto n = count.load(std::memory_order_relaxed);
+    if (n == 0) return 0;
+    auto rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(n));
+    rank = std::clamp<uint64_t>(rank, 1, n);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return lowerBoundOf(i);
+    }
+    return max.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    auto n = count.load(std::memory_order_relaxed);
+    if (n == 0) return 0.0;
+    return static_cast<double>(sum.load(std::memory_order_relaxed)) / n;
+}
+
+void addLatencyGauges(Gauges& gauges, std::string const& prefix,
+                      LatencyHistogram const& h) {
+    gauges[prefix + "_count"] = h.count.load();
+    gauges[prefix + "_total_ms"] = h.sum.load() / 1e6;
+    gauges[prefix + "_mean_us"] = h.mean() / 1e3;
+    gauges[prefix + "_p50_us"] = h.percentile(50) / 1e3;
+    gauges[prefix + "_p90_us"] = h.percentile(90) / 1e3;
+    gauges[prefix + "_p99_us"] = h.percentile(99) / 1e3;
+    gauges[prefix + "_max_us"] = h.max.load() / 1e3;
+}
+
+void StageStats::record(Clock::time_point begin, size_t nItems,
+                        size_t nBytes) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  Clock::now() - begin)
+                  .count();
+    calls.fetch_add(1, std::memory_order_relaxed);
+    items.fetch_add(nItems, std::memory_order_relaxed);
+    bytes.fetch_add(nBytes, std::memory_order_relaxed);
+    latency.record(static_cast<uint64_t>(ns));
+}
+
+StatsReport StageStats::report() const {
+    StatsReport r{.stage = stage};
+    if (gauges) r.values = gauges();
+    r.values["calls"] = calls.load();
+    r.values["items"] = items.load();
+    r.values["bytes"] = bytes.load();
+    r.values["errors"] = errors.load();
+    addLatencyGauges(r.values, "latency", latency);
+    for (auto const& input : inputs) {
+        if (input != nullptr) r.inputs.push_back(input->report());
+    }
+    return r;
+}
+
+size_t itemBytes(Item const& item) {
+    size_t n = 0;
+    for (auto const& [k, v] : item) {
+        if (auto t = std::get_if<Tensor>(&v)) {
+            if (t->defined()) n += t->nbytes();
+        } else if (auto s = std::get_if<std::string>(&v)) {
+            n += s->size();
+        }
+    }
+    return n;
+}
+
+struct ProfiledSampler final : Sampler {
+    SamplerHandle base;
+    StageStatsHandle st;
+    ProfiledSampler(SamplerHandle base, StageStatsHandle st)
+        : base{std::move(base)}, st{std::move(st)} {}
+
+    Item sample() override {
+        TraceScope scope(st->traceID);
+        auto begin = Clock::now();
+        try {
+            auto item = base->sample();
+            st->record(begin, 1, itemBytes(item));
+            return item;
+        } catch (...) {
+            st->errors += 1;
+            throw;
+        }
+    }
+    FlatItem sampleFlat() override {
+        TraceScope scope(st->traceID);
+        auto begin = Clock::now();
+        try {
+            auto item = base->sampleFlat();
+            st->record(begin, 1, 0);
+            return item;
+        } catch (...) {
+            st->errors += 1;
+            throw;
+        }
+    }
+    SharedItem sampleShared() override {
+        TraceScope scope(st->traceID);
+        auto begin = Clock::now();
+        try {
+            auto item = base->sampleShared();
+            st->record(begin, 1, itemBytes(*item));
+            return item;
+        } catch (...) {
+            st->errors += 1;
+            throw;
+        }
+    }
+    bool hasFlatPath() const override { return base->hasFlatPath(); }
+    StageStatsHandle stageStats() override { return st; }
+    Gauges gauges() override { return base->gauges(); }
+    void cancel() override { base->cancel(); }
+};
+
+struct ProfiledBatchSampler final : BatchSampler {
+    BatchSamplerHandle base;
+    StageStatsHandle st;
+    ProfiledBatchSampler(BatchSamplerHandle base, StageStatsHandle st)
+        : base{std::move(base)}, st{std::move(st)} {}
+
+    ItemList sample() override {
+        TraceScope scope(st->traceID);
+        auto begin = Clock::now();
+        try {
+            auto items = base->sample();
+            size_t nBytes = 0;
+            for (auto const& item : items) nBytes += itemBytes(item);
+            st->record(begin, items.size(), nBytes);
+            return items;
+        } catch (...) {
+            st->errors += 1;
+            throw;
+        }
+    }
+    StageStatsHandle stageStats() override { return st; }
+    Gauges gauges() override { return base->gauges(); }
+    void cancel() override { base->cancel(); }
+};
+
+struct ProfiledDataset final : Dataset {
+    DatasetHandle base;
+    StageStatsHandle st;
+    ProfiledDataset(DatasetHandle base, StageStatsHandle st)
+        : base{std::move(base)}, st{std::move(st)} {}
+
+    template <typename F> auto timed(F&& f) {
+        TraceScope scope(st->traceID);
+        auto begin = Clock::now();
+        try {
+            auto item = f();
+            if constexpr (std::is_same_v<decltype(item), SharedItem>) {
+                st->record(begin, 1, itemBytes(*item));
+            } else {
+                st->record(begin, 1, itemBytes(item));
+            }
+            return item;
+        } catch (...) {
+            st->errors += 1;
+            throw;
+        }
+    }
+
+    KeyList const& keyList() override { return base->keyList(); }
+    size_t size() override { return base->size(); }
+    bool contains(std::string_view key) override {
+        return base->contains(key);
+    }
+    std::string_view getKey(size_t idx) override { return base->getKey(idx); }
+
+    Item operator[](std::string_view key) override {
+        return timed([&] { return (*base)[key]; });
+    }
+    Item getItem(size_t idx) override {
+        return timed([&] { return base->getItem(idx); });
+    }
+    SharedItem sharedItem(std::string_view key) override {
+        return timed([&] { return base->sharedItem(key); });
+    }
+    SharedItem getSharedItem(size_t idx) override {
+        return timed([&] { return base->getSharedItem(idx); });
+    }
+    std::optional<ValueType> metadata(std::string_view key,
+                                      std::string_view field) override {
+        return base->metadata(key, field);
+    }
+    std::vector<int> partitions() override { return base->partitions(); }
+    StageStatsHandle stageStats() override { return st; }
+    Gauges gauges() override { return base->gauges(); }
+};
+
+template <typename Handle>
+StageStatsHandle makeStats(Handle const& base, std::string stage,
+                           std::vector<StageStatsHandle> inputs) {
+    auto st = std::make_shared<StageStats>(std::move(stage), std::move(inputs));
+    // A weak reference, the stats may outlive the stage.
+    st->gauges = [w = std::weak_ptr(base)] {
+        auto p = w.lock();
+        return p ? p->gauges() : Gauges{};
+    };
+    return st;
+}
+
+SamplerHandle instrument(SamplerHandle s, std::string stage,
+                         std::vector<StageStatsHandle> inputs) {
+    if (not profilingEnabled()) return s;
+    auto st = makeStats(s, std::move(stage), std::move(inputs));
+    return std::make_shared<ProfiledSampler>(std::move(s), std::move(st));
+}
+
+BatchSamplerHandle instrument(BatchSamplerHandle s, std::string stage,
+                              std::vector<StageStatsHandle> inputs) {
+    if (not profilingEnabled()) return s;
+    auto st = makeStats(s, std::move(stage), std::move(inputs));
+    return std::make_shared<ProfiledBatchSampler>(std::move(s), std::move(st));
+}
+
+DatasetHandle instrument(DatasetHandle d, std::string stage,
+                         std::vector<StageStatsHandle> inputs) {
+    if (not profilingEnabled()) return d;
+    auto st = makeStats(d, std::move(stage), std::move(inputs));
+    return std::make_shared<ProfiledDataset>(std::move(d), std::move(st));
+}
+
+SamplerHandle uninstrumented(SamplerHandle s) {
+    if (auto p = std::dynamic_pointer_cast<ProfiledSampler>(s)) return p->base;
+    return s;
+}
+
+}  // namespace data
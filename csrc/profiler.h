@@ -0,0 +1,104 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+#include "types.h"
+
+/*
+Optional per-stage instrumentation of the pipeline. While profiling is
+enabled, the factory functions of Sampler, BatchSampler and Dataset wrap the
+stage they build into a profiled stage, which records call counts, latency,
+items and bytes out. Stats of a stage and all its profiled inputs are
+collected with stats(). Profiled stages also record trace events, see
+trace.h.
+*/
+
+namespace data {
+
+// Stages built while profiling is enabled are instrumented. Stages built
+// before are not affected.
+void setProfiling(bool enabled);
+bool profilingEnabled();
+
+// HDR-style latency histogram. Values are bucketed by their highest bit, and
+// each power of two is split into kSub linear sub-buckets, bounding the
+// relative error by 1 / kSub. Recording is lock-free.
+struct LatencyHistogram {
+    static constexpr int kSubBits = 3;
+    static constexpr int kSub = 1 << kSubBits;
+    static constexpr int kBuckets = (64 - kSubBits + 1) * kSub;
+
+    std::array<std::atomic<uint64_t>, kBuckets> counts{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+    void record(uint64_t ns);
+    // Lower bound of the bucket holding the p-th percentile, p in [0, 100].
+    [[nodiscard]] uint64_t percentile(double p) const;
+    [[nodiscard]] double mean() const;
+};
+
+using Gauges = std::map<std::string, double>;
+
+// A nested report of stage stats, see Sampler::stats().
+struct StatsReport {
+    std::string stage{};
+    Gauges values{};
+    std::vector<StatsReport> inputs{};
+};
+
+struct StageStats;
+using StageStatsHandle = std::shared_ptr<StageStats>;
+
+struct StageStats {
+    std::string stage;
+    uint32_t traceID;
+    std::vector<StageStatsHandle> inputs;
+    // Gauges read from the wrapped stage, e.g. queue occupancy.
+    std::function<Gauges()> gauges;
+
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+    LatencyHistogram latency;
+
+    StageStats(std::string stage, std::vector<StageStatsHandle> inputs)
+        : stage{std::move(stage)},
+          traceID{traceName(this->stage)},
+          inputs{std::move(inputs)} {}
+
+    void record(std::chrono::steady_clock::time_point begin, size_t nItems,
+                size_t nBytes);
+    [[nodiscard]] StatsReport report() const;
+};
+
+// Approximate memory held by an item: tensor storage and string bytes.
+size_t itemBytes(Item const& item);
+
+// Add the stats of a histogram to gauges, as `<prefix>_mean_us` etc.
+void addLatencyGauges(Gauges& gauges, std::string const& prefix,
+                      LatencyHistogram const& h);
+
+// Wrap a stage with instrumentation if profiling is enabled, otherwise return
+// it unchanged. inputs are the upstream stages, whose stats are nested.
+SamplerHandle instrument(SamplerHandle s, std::string stage,
+                         std::vector<StageStatsHandle> inputs);
+BatchSamplerHandle instrument(BatchSamplerHandle s, std::string stage,
+                              std::vector<StageStatsHandle> inputs);
+DatasetHandle instrument(DatasetHandle d, std::string stage,
+                         std::vector<StageStatsHandle> inputs);
+
+// The stage wrapped by instrument(), or s itself if it is not instrumented.
+SamplerHandle uninstrumented(SamplerHandle s);
+
+}  // namespace data
@@ -0,0 +1,63 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+
+namespace data {
+
+// Restores the order of values produced out of order by parallel workers.
+// Values are numbered from 0. A worker acquires a number before producing its
+// value, which blocks while it is window or more ahead of the next value to
+// take, bounding the memory held by out-of-order values.
+template <typename T> class ReorderBuffer {
+   public:
+    explicit ReorderBuffer(size_t window) : window{window} {}
+
+    // Block until seq is in the window. Returns false if closed.
+    bool acquire(uint64_t seq) {
+        std::unique_lock lock(m);
+        cv.wait(lock, [&] { return closed or seq < next + window; });
+        return not closed;
+    }
+
+    void put(uint64_t seq, T value) {
+        std::lock_guard guard(m);
+        if (closed) return;
+        ready.emplace(seq, std::move(value));
+        cv.notify_all();
+    }
+
+    // Block until the next value is ready, or until the values before end
+    // are all taken. Returns nothing if closed or at end.
+    std::optional<T> take(uint64_t end = UINT64_MAX) {
+        std::unique_lock lock(m);
+        cv.wait(lock, [&] {
+            return closed or next >= end or
+                   (not ready.empty() and ready.begin()->first == next);
+        });
+        if (closed or next >= end) return std::nullopt;
+        auto node = ready.extract(ready.begin());
+        next += 1;
+        cv.notify_all();
+        return std::move(node.mapped());
+    }
+
+    // Wake all waiters, later calls return immediately.
+    void close() {
+        std::lock_guard guard(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+   private:
+    size_t window;
+    std::mutex m;
+    std::condition_variable cv;
+    std::map<uint64_t, T> ready;
+    uint64_t next{0};
+    bool closed{false};
+};
+
+}  // namespace data
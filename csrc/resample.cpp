@@ -0,0 +1,231 @@
+#include "resample.h"
+
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+namespace data {
+
+namespace {
+// There are a lot of specifications here, you may want to tune them.
+// Typically precision = 16, the higher the better.
+soxr_quality_spec_t qualitySpec(ResampleQuality quality) {
+    switch (quality) {
+        case ResampleQuality::Quick:
+            return soxr_quality_spec(SOXR_QQ, 0);
+        case ResampleQuality::Low:
+            return soxr_quality_spec(SOXR_LQ, 0);
+        case ResampleQuality::Medium:
+            return soxr_quality_spec(SOXR_MQ, 0);
+        case ResampleQuality::High:
+            return soxr_quality_spec(SOXR_HQ, 0);
+        case ResampleQuality::VeryHigh:
+            return soxr_quality_spec(SOXR_VHQ, 0);
+        default:
+            return {.precision = 20,
+                    .phase_response = 50,
+                    .passband_end = 0.95,
+                    .stopband_begin = 1.0};
+    }
+}
+
+soxr_datatype_t soxrType(torch::ScalarType dtype) {
+    switch (dtype) {
+        case torch::kInt16:
+            return SOXR_INT16_I;
+        case torch::kInt32:
+            return SOXR_INT32_I;
+        case torch::kFloat32:
+            return SOXR_FLOAT32_I;
+        default:
+            throw std::runtime_error(
+                "Can only resample int16, int32 or float32.");
+    }
+}
+
+soxr_t createSoxr(double inRate, double outRate, unsigned channels,
+                  torch::ScalarType dtype, ResampleQuality quality) {
+    auto type = soxrType(dtype);
+    auto io = soxr_io_spec(type, type);
+    auto q = qualitySpec(quality);
+    // Loader threads already run in parallel.
+    auto runtime = soxr_runtime_spec(1);
+    soxr_error_t error = nullptr;
+    auto r = soxr_create(inRate, outRate, channels, &error, &io, &q, &runtime);
+    if (error != nullptr) {
+        soxr_delete(r);
+        throw std::runtime_error(std::string("soxr_create: ") + error);
+    }
+    return r;
+}
+
+// soxr instances of this thread, cleared between uses instead of created and
+// deleted for every call. A handful of keys is typical, the cache is capped
+// in case rates vary per item, evicting the least recently used instance.
+soxr_t cachedSoxr(double inRate, double outRate, unsigned channels,
+                  torch::ScalarType dtype, ResampleQuality quality) {
+    using Key = std::tuple<double, double, unsigned, torch::ScalarType,
+                           ResampleQuality>;
+    struct Entry {
+        soxr_t r;
+        uint64_t lastUse;
+    };
+    struct Cache {
+        std::map<Key, Entry> entries;
+        uint64_t clock{0};
+        ~Cache() {
+            for (auto& [key, e] : entries) soxr_delete(e.r);
+        }
+    };
+    constexpr size_t maxEntries = 16;
+    thread_local Cache cache;
+
+    Key key{inRate, outRate, channels, dtype, quality};
+    cache.clock += 1;
+    if (auto it = cache.entries.find(key); it != cache.entries.end()) {
+        it->second.lastUse = cache.clock;
+        soxr_clear(it->second.r);
+        return it->second.r;
+    }
+    if (cache.entries.size() >= maxEntries) {
+        auto lru = std::min_element(
+            cache.entries.begin(), cache.entries.end(),
+            [](auto const& a, auto const& b) {
+                return a.second.lastUse < b.second.lastUse;
+            });
+        soxr_delete(lru->second.r);
+        cache.entries.erase(lru);
+    }
+    auto r = createSoxr(inRate, outRate, channels, dtype, quality);
+    cache.entries.emplace(key, Entry{r, cache.clock});
+    return r;
+}
+
+char* frame(Tensor& t, size_t i) {
+    return static_cast<char*>(t.data_ptr()) + i * t.stride(0) * t.itemsize();
+}
+
+// Feed the input to r, and collect up to maxOut frames. With last, the input
+// is the end of the signal and the filter is flushed. Sets used to the number
+// of input frames consumed.
+Tensor drain(soxr_t r, Tensor in, size_t maxOut, bool last, size_t& used) {
+    in = in.contiguous();
+    size_t n = in.size(0);
+    auto out = torch::empty(
+        {static_cast<int64_t>(maxOut), in.size(1)}, in.options());
+    size_t done = 0;
+    used = 0;
+    while (done < maxOut) {
+        size_t idone = 0, odone = 0;
+        soxr_error_t error;
+        if (used < n) {
+            // ~n tells soxr this is the last input.
+            auto len = last ? ~(n - used) : n - used;
+            error = soxr_process(r, frame(in, used), len, &idone,
+                                 frame(out, done), maxOut - done, &odone);
+        } else if (last) {
+            error = soxr_process(r, nullptr, 0, nullptr, frame(out, done),
+                                 maxOut - done, &odone);
+        } else {
+            break;
+        }
+        if (error != nullptr) {
+            throw std::runtime_error(std::string("soxr_process: ") + error);
+        }
+        used += idone;
+        done += odone;
+        if (idone == 0 and odone == 0) break;
+    }
+    return out.narrow(0, 0, static_cast<int64_t>(done));
+}
+}  // namespace
+
+Tensor resample(Tensor inWave, double inRate, double outRate,
+                ResampleQuality quality) {
+    unsigned channels = inWave.size(1);
+    size_t inLength = inWave.size(0);
+    auto outLength = static_cast<size_t>(inLength * outRate / inRate + .5);
+    auto r = cachedSoxr(inRate, outRate, channels, inWave.scalar_type(),
+                        quality);
+    size_t used;
+    return drain(r, inWave, outLength, true, used);
+}
+
+Resampler::Resampler(double inRate, double outRate, unsigned channels,
+                     torch::ScalarType dtype, ResampleQuality quality)
+    : ratio{outRate / inRate},
+      channels{channels},
+      dtype{dtype},
+      r{createSoxr(inRate, outRate, channels, dtype, quality)} {}
+
+Tensor Resampler::process(Tensor chunk) {
+    if (chunk.scalar_type() != dtype or chunk.size(1) != channels) {
+        throw std::runtime_error("Resampler chunk type or channels changed.");
+    }
+    // The output of a chunk may include frames buffered from earlier ones.
+    auto maxOut = static_cast<size_t>(chunk.size(0) * ratio) + 1024;
+    std::vector<Tensor> parts;
+    while (true) {
+        size_t used;
+        auto out = drain(r.get(), chunk, maxOut, false, used);
+        if (out.size(0) > 0) parts.push_back(out);
+        chunk = chunk.narrow(0, static_cast<int64_t>(used),
+                             chunk.size(0) - static_cast<int64_t>(used));
+        if (static_cast<size_t>(out.size(0)) < maxOut) break;
+    }
+    if (parts.empty()) {
+        return torch::empty({0, static_cast<int64_t>(channels)}, dtype);
+    }
+    return parts.size() == 1 ? parts[0] : torch::cat(parts);
+}
+
+Tensor Resampler::flush() {
+    auto empty = torch::empty({0, static_cast<int64_t>(channels)}, dtype);
+    std::vector<Tensor> parts;
+    while (true) {
+        size_t used;
+        auto out = drain(r.get(), empty, 4096, true, used);
+        if (out.size(0) == 0) break;
+        parts.push_back(out);
+    }
+    reset();
+    if (parts.empty()) return empty;
+    return parts.size() == 1 ? parts[0] : torch::cat(parts);
+}
+
+void Resampler::reset() { soxr_clear(r.get()); }
+
+struct ResampleTransform final : public ItemTransform {
+    std::string waveKey;
+    std::string srKey;
+    double outRate;
+    ResampleQuality quality;
+
+    ResampleTransform(std::string waveKey, std::string srKey, double outRate,
+                      ResampleQuality quality)
+        : waveKey{waveKey}, srKey{srKey}, outRate{outRate}, quality{quality} {}
+
+    Item operator()(Item item) override {
+        auto inRate = std::get<double>(resolve(item[srKey]));
+        if (inRate != outRate) {
+            auto w = std::get<Tensor>(resolve(item[waveKey]));
+            item[waveKey] = resample(w, inRate, outRate, quality);
+            item[srKey] = outRate;
+        }
+        return item;
+    }
+};
+
+ItemTransformHandle resampleTransform(std::string waveKey, std::string srKey,
+                                      double outRate,
+                                      ResampleQuality quality) {
+    return std::make_shared<ResampleTransform>(waveKey, srKey, outRate,
+                                               quality);
+}
+
+}  // namespace data
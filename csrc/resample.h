@@ -0,0 +1,64 @@
+#pragma once
+#include <soxr.h>
+
+#include <memory>
+#include <string>
+
+#include "types.h"
+
+/*
+Sample rate conversion with soxr. Setting up a resampler dominates the cost
+of resampling short utterances, so one-shot calls reuse a per-thread soxr
+instance for each (rates, channels, dtype, quality), cleared between calls.
+Lower quality presets also design much shorter filters.
+Waves are [nSample, nChannel], int16, int32 or float32. soxr adds TPDF
+dither to int16 outputs.
+*/
+
+namespace data {
+
+enum class ResampleQuality {
+    // The tuned spec used so far: 20 bits, linear phase, 95% passband.
+    Default,
+    Quick,
+    Low,
+    Medium,
+    High,
+    VeryHigh,
+};
+
+// Resample an audio from inRate to outRate.
+Tensor resample(Tensor inWave, double inRate, double outRate,
+                ResampleQuality quality = ResampleQuality::Default);
+
+// Resample a long signal chunk by chunk, keeping the filter state between
+// chunks, so the output is the same as resampling it at once.
+class Resampler {
+   public:
+    Resampler(double inRate, double outRate, unsigned channels,
+              torch::ScalarType dtype = torch::kFloat32,
+              ResampleQuality quality = ResampleQuality::Default);
+
+    // Returns the output available so far, which lags behind the input by
+    // the filter delay.
+    Tensor process(Tensor chunk);
+    // Returns the remaining output, after which the resampler is reset.
+    Tensor flush();
+    void reset();
+
+   private:
+    struct SoxrDeleter {
+        void operator()(soxr_t r) const { soxr_delete(r); }
+    };
+    double ratio;
+    unsigned channels;
+    torch::ScalarType dtype;
+    std::unique_ptr<soxr, SoxrDeleter> r;
+};
+
+// Resample waveKey from the rate in srKey to outRate, and set srKey.
+ItemTransformHandle resampleTransform(std::string waveKey, std::string srKey,
+                                      double outRate,
+                                      ResampleQuality quality);
+
+}  // namespace data
@@ -7,22 +7,64 @@
 
 #include <algorithm>
 #include <boost/thread/sync_bounded_queue.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <memory>
 #include <mutex>
+#include <numeric>
+#include <optional>
 #include <stdexcept>
 #include <variant>
 
 #include "dataset.h"
+#include "item.h"
+#include "reorder.h"
 #include "tensor_utils.h"
+#include "trace.h"
 #include "types.h"
 
 namespace data {
 
+FlatItem Sampler::sampleFlat() { return FlatItem(sample()); }
+
+SharedItem Sampler::sampleShared() { return SharedItem(sample()); }
+
+namespace {
+// Draw from base as a FlatItem if it has a flat path, or else as an Item,
+// and pass it to f, which reads fields through field().
+template <typename F> decltype(auto) withSample(Sampler& base, F&& f) {
+    if (base.hasFlatPath()) {
+        auto item = base.sampleFlat();
+        return f(item);
+    }
+    auto item = base.sample();
+    return f(item);
+}
+
+Item asItem(Item&& item) { return std::move(item); }
+Item asItem(FlatItem&& item) { return std::move(item).toItem(); }
+
+// Item idx of d holding its key in "key", as sampled items do. It is shared
+// with d when d already stores the key, as in-memory datasets do.
+SharedItem keyedItem(Dataset& d, size_t idx) {
+    auto key = d.getKey(idx);
+    auto item = d.getSharedItem(idx);
+    auto it = item->find("key");
+    auto stored = it == item->end() ? nullptr
+                                    : std::get_if<std::string>(&it->second);
+    if (stored == nullptr or *stored != key) {
+        item.mutate().insert_or_assign("key", std::string(key));
+    }
+    return item;
+}
+}  // namespace
+
 struct SegmentedSampler final : Sampler {
     SamplerHandle base{};
     size_t segmentSize{};
     int64_t dim{0};
-    std::string bufferKey;
+    ItemField bufferKey;
     tbb::enumerable_thread_specific<TensorBuffer> buffers;
     SegmentedSampler(SamplerHandle s, std::string_view bufferKey,
                      size_t segmentSize, int64_t dim)
@@ -31,24 +73,38 @@ struct SegmentedSampler final : Sampler {
           segmentSize{segmentSize},
           dim{dim} {}
 
-    Item sample() override {
+    Tensor nextSegment() {
         auto& buffer = buffers.local();
         buffer.dim = dim;
         while (buffer.size() < segmentSize) {
-            auto item = base->sample();
-            Tensor A = std::get<Tensor>(item[bufferKey]);
-            buffer.push(A);
+            buffer.push(withSample(*base, [&](auto& item) {
+                return std::get<Tensor>(field(item, bufferKey));
+            }));
         }
-        Tensor A = buffer.pop(segmentSize);
+        return buffer.pop(segmentSize);
+    }
+
+    Item sample() override {
         Item it;
-        it.emplace(bufferKey, std::move(A));
+        it.emplace(bufferKey.name, nextSegment());
+        return it;
+    }
+
+    FlatItem sampleFlat() override {
+        FlatItem it;
+        it[bufferKey.id] = nextSegment();
         return it;
     }
+    bool hasFlatPath() const override { return true; }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle segmentSampler(SamplerHandle s, std::string_view bufferKey,
                              size_t segmentSize, int64_t dim) {
-    return std::make_shared<SegmentedSampler>(s, bufferKey, segmentSize, dim);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(
+        std::make_shared<SegmentedSampler>(s, bufferKey, segmentSize, dim),
+        "segment", std::move(inputs));
 }
 
 /*
@@ -60,7 +116,7 @@ buffer must be no less than segment_size!
 struct SliceSegmentedSampler final : BatchSampler {
     SamplerHandle base;
     size_t segmentSize;
-    std::string bufferKey;
+    ItemField bufferKey;
     int64_t dim;
     tbb::enumerable_thread_specific<std::mt19937> rng;
     SliceSegmentedSampler(SamplerHandle s, std::string_view bufferKey,
@@ -79,8 +135,9 @@ struct SliceSegmentedSampler final : BatchSampler {
         }
 
         // Sample an item:
-        auto it = base->sample();
-        Tensor A = std::get<Tensor>(it[bufferKey]);
+        Tensor A = withSample(*base, [&](auto& item) {
+            return std::get<Tensor>(field(item, bufferKey));
+        });
         int64_t N = A.size(dim);
         if (N < segmentSize) {
             throw std::runtime_error(
@@ -94,17 +151,20 @@ struct SliceSegmentedSampler final : BatchSampler {
         ItemList lst;
         for (size_t i = 0; i <= N - segmentSize; i += segmentSize) {
             auto S = A.slice(dim, i, i + segmentSize);
-            lst.push_back(Item{{bufferKey, S}});
+            lst.push_back(Item{{bufferKey.name, S}});
         }
         return lst;
     }
+    void cancel() override { base->cancel(); }
 };
 
 BatchSamplerHandle segmentSamplerSlicing(SamplerHandle s,
                                          std::string_view bufferKey,
                                          size_t segmentSize, int64_t dim) {
-    return std::make_shared<SliceSegmentedSampler>(s, bufferKey, segmentSize,
-                                                   dim);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<SliceSegmentedSampler>(
+                          s, bufferKey, segmentSize, dim),
+                      "segmentSlicing", std::move(inputs));
 }
 
 /*
@@ -116,8 +176,8 @@ this class.
 struct ClasswiseSegmentedSampler final : Sampler {
     SamplerHandle base;
     size_t segmentSize;
-    std::string bufferKey;
-    std::string classKey;
+    ItemField bufferKey;
+    ItemField classKey;
     int64_t dim;
 
     tbb::enumerable_thread_specific<std::map<int64_t, TensorBuffer>> buffers;
@@ -137,8 +197,8 @@ struct ClasswiseSegmentedSampler final : Sampler {
         auto& _currentBuffer = currentBuffer.local();
         Item it;
         auto A = _currentBuffer->pop(segmentSize);
-        it.emplace(bufferKey, A);
-        it.emplace(classKey, currentCls.local());
+        it.emplace(bufferKey.name, A);
+        it.emplace(classKey.name, currentCls.local());
         return it;
     }
 
@@ -151,90 +211,208 @@ struct ClasswiseSegmentedSampler final : Sampler {
             return popCurrentBuffer();
         }
         while (true) {
-            auto it = base->sample();
-            _currentCls = std::get<int64_t>(it[classKey]);
+            auto [cls, A] = withSample(*base, [&](auto& item) {
+                return std::pair{std::get<int64_t>(field(item, classKey)),
+                                 std::get<Tensor>(field(item, bufferKey))};
+            });
+            _currentCls = cls;
             _currentBuffer = &_buffers[_currentCls];
             _currentBuffer->dim = dim;
-            Tensor A = std::get<Tensor>(it[bufferKey]);
             _currentBuffer->push(A);
             if (_currentBuffer->size() >= segmentSize) {
                 return popCurrentBuffer();
             }
         }
     }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle segmentSamplerClasswise(SamplerHandle s,
                                       std::string_view bufferKey,
                                       std::string_view classKey,
                                       size_t segmentSize, int64_t dim) {
-    return std::make_shared<ClasswiseSegmentedSampler>(s, bufferKey, classKey,
-                                                       segmentSize, dim);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<ClasswiseSegmentedSampler>(
+                          s, bufferKey, classKey, segmentSize, dim),
+                      "segmentClasswise", std::move(inputs));
 }
 
 struct SampledDataset final : Sampler {
     DatasetHandle base;
     tbb::enumerable_thread_specific<std::mt19937> rng;
     explicit SampledDataset(DatasetHandle base) : base{base} {}
-    Item sample() override {
+    Item sample() override { return std::move(sampleShared()).take(); }
+    SharedItem sampleShared() override {
         bool rng_exists;
         auto& _rng = rng.local(rng_exists);
         if (not rng_exists) {
             _rng.seed(std::random_device()());
         }
         auto dist = std::uniform_int_distribution<size_t>(0, base->size() - 1);
-        auto dice = dist(_rng);
-
-        auto key = base->getKey(dice);
-        auto it = base->getItem(dice);
-
-        it.insert_or_assign("key", key.data());
-        return it;
+        return keyedItem(*base, dist(_rng));
     }
 };
 
 SamplerHandle sampleDataset(DatasetHandle d) {
-    return std::make_shared<SampledDataset>(d);
+    if (d->size() == 0) {
+        throw std::runtime_error("Can not sample an empty dataset.");
+    }
+    auto inputs = std::vector{d->stageStats()};
+    return instrument(std::make_shared<SampledDataset>(d), "sampleDataset",
+                      std::move(inputs));
 }
 
+// Without a seed, each epoch is shuffled from std::random_device.
+// With a seed, all ranks of a distributed job shuffle the items of an epoch
+// the same way, and each keeps its share, so ranks are disjoint without
+// coordination:
+//  - Without weights, ranks take every worldSize-th item.
+//  - With weights, e.g. the item counts of shards, items are sorted by weight
+//    and dealt in tiers of worldSize items, each rank taking one item of a
+//    tier in an order drawn for the tier. Rank totals then differ by at most
+//    the spread of the weights, and shares change every epoch. The share of
+//    a rank is then shuffled again.
+// Either way the last size % worldSize items of the shuffled epoch are
+// dropped, so all ranks have the same epoch length.
 struct PermuteSampledDataset final : Sampler {
     DatasetHandle base;
+    size_t rank{0};
+    size_t worldSize{1};
+    std::optional<uint64_t> seed{};
+    std::string weightKey{};
+    std::vector<double> weights{};
     std::mutex lock{};
     size_t nextIdx{0};
     size_t baseSize{0};
+    uint64_t epoch{0};
     std::vector<size_t> indices{};
+
     void next_shuffle() {
-        std::shuffle(indices.begin(), indices.end(),
-                     std::mt19937{std::random_device{}()});
+        std::vector<size_t> all(baseSize);
+        std::iota(all.begin(), all.end(), 0);
+        std::mt19937_64 rng;
+        if (seed) {
+            std::seed_seq seq{static_cast<uint32_t>(*seed),
+                              static_cast<uint32_t>(*seed >> 32),
+                              static_cast<uint32_t>(epoch),
+                              static_cast<uint32_t>(epoch >> 32)};
+            rng.seed(seq);
+        } else {
+            rng.seed(std::random_device{}());
+        }
+        epoch += 1;
+        std::shuffle(all.begin(), all.end(), rng);
+        if (worldSize == 1) {
+            indices = std::move(all);
+        } else if (weights.empty()) {
+            indices.clear();
+            for (size_t i = 0; i < baseSize / worldSize; ++i) {
+                indices.push_back(all[i * worldSize + rank]);
+            }
+        } else {
+            all.resize(baseSize / worldSize * worldSize);
+            // Stable, items of equal weight keep their shuffled order.
+            std::stable_sort(all.begin(), all.end(), [&](size_t a, size_t b) {
+                return weights[a] > weights[b];
+            });
+            std::vector<size_t> order(worldSize);
+            std::iota(order.begin(), order.end(), 0);
+            indices.clear();
+            for (size_t t = 0; t < all.size(); t += worldSize) {
+                std::shuffle(order.begin(), order.end(), rng);
+                indices.push_back(all[t + order[rank]]);
+            }
+            std::shuffle(indices.begin(), indices.end(), rng);
+        }
+        if (indices.empty()) {
+            throw std::runtime_error("No items left for rank " +
+                                     std::to_string(rank) + ".");
+        }
     }
 
     explicit PermuteSampledDataset(DatasetHandle base)
-        : base{base}, baseSize{base->size()}, indices(baseSize) {
-        std::iota(indices.begin(), indices.end(), 0);
+        : base{base}, baseSize{base->size()} {
         next_shuffle();
     }
 
-    Item sample() override {
+    PermuteSampledDataset(DatasetHandle base, size_t rank, size_t worldSize,
+                          uint64_t seed, std::string weightKey)
+        : base{base},
+          rank{rank},
+          worldSize{worldSize},
+          seed{seed},
+          weightKey{std::move(weightKey)},
+          baseSize{base->size()} {
+        if (worldSize == 0 or rank >= worldSize) {
+            throw std::runtime_error("Invalid rank " + std::to_string(rank) +
+                                     " of " + std::to_string(worldSize) + ".");
+        }
+        if (not this->weightKey.empty()) {
+            weights.reserve(baseSize);
+            for (size_t i = 0; i < baseSize; ++i) {
+                weights.push_back(weightOf(i));
+            }
+        }
+        next_shuffle();
+    }
+
+    // Read from the metadata index if possible.
+    double weightOf(size_t idx) {
+        auto value = base->metadata(base->getKey(idx), weightKey);
+        if (not value) value = base->getItem(idx).at(weightKey);
+        auto const& v = loaded(*value);
+        if (auto p = std::get_if<int64_t>(&v)) return static_cast<double>(*p);
+        if (auto p = std::get_if<double>(&v)) return *p;
+        throw std::runtime_error("Weight " + weightKey + " is not a number.");
+    }
+
+    // The same sampling over another dataset, see filterSampler().
+    SamplerHandle rebase(DatasetHandle d) {
+        if (not seed) return permuteSampleDataset(std::move(d));
+        return distributedPermuteSampleDataset(std::move(d), rank, worldSize,
+                                               *seed, weightKey);
+    }
+
+    Item sample() override { return std::move(sampleShared()).take(); }
+    SharedItem sampleShared() override {
         size_t localIdx;
         {
             const std::lock_guard<std::mutex> lg(lock);
             localIdx = indices[nextIdx];
             nextIdx += 1;
-            if (nextIdx == baseSize) {
+            if (nextIdx == indices.size()) {
                 nextIdx = 0;
                 next_shuffle();
             }
         }
-        auto key = base->getKey(localIdx);
-        auto it = base->getItem(localIdx);
-
-        it.insert_or_assign("key", key.data());
-        return it;
+        return keyedItem(*base, localIdx);
     }
 };
 
 SamplerHandle permuteSampleDataset(DatasetHandle d) {
-    return std::make_shared<PermuteSampledDataset>(d);
+    auto inputs = std::vector{d->stageStats()};
+    return instrument(std::make_shared<PermuteSampledDataset>(d),
+                      "permuteSampleDataset", std::move(inputs));
+}
+
+SamplerHandle distributedPermuteSampleDataset(DatasetHandle d, size_t rank,
+                                              size_t worldSize, uint64_t seed,
+                                              std::string weightKey) {
+    auto inputs = std::vector{d->stageStats()};
+    return instrument(std::make_shared<PermuteSampledDataset>(
+                          d, rank, worldSize, seed, std::move(weightKey)),
+                      "distributedPermuteSampleDataset", std::move(inputs));
+}
+
+// Sample a loaded shard, sharing its items between ranks if distributed. The
+// seed is mixed with the shard ID, so every shard is split differently.
+static SamplerHandle sampleLoadedShard(DatasetHandle shard, int64_t shardID,
+                                       size_t rank, size_t worldSize,
+                                       uint64_t seed) {
+    if (worldSize == 1) return shard->permuteSample();
+    auto mixed = seed ^ (static_cast<uint64_t>(shardID) * 0x9E3779B97F4A7C15);
+    return distributedPermuteSampleDataset(std::move(shard), rank, worldSize,
+                                           mixed, "");
 }
 
 struct SampledSamplers final : Sampler {
@@ -260,14 +438,19 @@ struct SampledSamplers final : Sampler {
         auto base = bases[dice];
         return base->sample();
     }
+    void cancel() override { for (auto& b : bases) b->cancel(); }
 };
 
 SamplerHandle sampleSamplers(SamplerList samplers, StringList samplerIDs,
                              DoubleList weights) {
     assert(samplers.size() == samplerIDs.size() &&
            samplerIDs.size() == weights.size());
-    return std::make_shared<SampledSamplers>(
-        std::move(samplers), std::move(samplerIDs), std::move(weights));
+    std::vector<StageStatsHandle> inputs;
+    for (auto const& s : samplers) inputs.push_back(s->stageStats());
+    return instrument(
+        std::make_shared<SampledSamplers>(
+            std::move(samplers), std::move(samplerIDs), std::move(weights)),
+        "sampleSamplers", std::move(inputs));
 }
 
 struct ShardSampler final : Sampler {
@@ -275,18 +458,26 @@ struct ShardSampler final : Sampler {
     std::string shardPathKey;
     std::string shardIDKey;
     size_t samplesPerShard{};
+    size_t rank;
+    size_t worldSize;
+    uint64_t seed;
     std::mutex lock;
     size_t sampleCounter{};
     DatasetHandle currentShard;
     int64_t currentShardID;
     SamplerHandle currentSampler;
+    LatencyHistogram loadLatency;
 
     ShardSampler(SamplerHandle base, std::string shardPathKey,
-                 std::string shardIDKey, size_t samplesPerShard)
+                 std::string shardIDKey, size_t samplesPerShard, size_t rank,
+                 size_t worldSize, uint64_t seed)
         : base{std::move(base)},
           shardPathKey{std::move(shardPathKey)},
           shardIDKey{std::move(shardIDKey)},
           samplesPerShard{samplesPerShard},
+          rank{rank},
+          worldSize{worldSize},
+          seed{seed},
           sampleCounter{0} {
         loadNextShard();
     }
@@ -296,8 +487,21 @@ struct ShardSampler final : Sampler {
         auto item = base->sample();
         auto shardPath = std::get<std::string>(item[shardPathKey]);
         currentShardID = std::get<int64_t>(item[shardIDKey]);
+        static auto const loadName = traceName("loadNextShard");
+        TraceScope scope(loadName);
+        auto begin = std::chrono::steady_clock::now();
         currentShard = loadShard(shardPath);
-        currentSampler = currentShard->permuteSample();
+        currentSampler = sampleLoadedShard(currentShard, currentShardID, rank,
+                                           worldSize, seed);
+        loadLatency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - begin)
+                               .count());
+    }
+
+    Gauges gauges() override {
+        Gauges g;
+        addLatencyGauges(g, "shard_load", loadLatency);
+        return g;
     }
 
     Item sample() override {
@@ -313,12 +517,17 @@ struct ShardSampler final : Sampler {
         item["shard_id"] = currentShardID;
         return item;
     }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle sampleShard(SamplerHandle s, std::string shardPathKey,
-                          std::string shardIDKey, size_t samplesPerShard) {
-    return std::make_shared<ShardSampler>(s, shardPathKey, shardIDKey,
-                                          samplesPerShard);
+                          std::string shardIDKey, size_t samplesPerShard,
+                          size_t rank, size_t worldSize, uint64_t seed) {
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<ShardSampler>(
+                          s, shardPathKey, shardIDKey, samplesPerShard, rank,
+                          worldSize, seed),
+                      "sampleShard", std::move(inputs));
 }
 
 struct ZippedShardSampler final : Sampler {
@@ -326,19 +535,27 @@ struct ZippedShardSampler final : Sampler {
     StringList shardPathKeys;
     std::string shardIDKey;
     size_t samplesPerShard{};
+    size_t rank;
+    size_t worldSize;
+    uint64_t seed;
     std::mutex lock;
     size_t sampleCounter{};
     DatasetList currentShards;
     DatasetHandle currentZippedShards;
     int64_t currentShardID;
     SamplerHandle currentSampler;
+    LatencyHistogram loadLatency;
 
     ZippedShardSampler(SamplerHandle base, StringList shardPathKeys,
-                       std::string shardIDKey, size_t samplesPerShard)
+                       std::string shardIDKey, size_t samplesPerShard,
+                       size_t rank, size_t worldSize, uint64_t seed)
         : base{std::move(base)},
           shardPathKeys{std::move(shardPathKeys)},
           shardIDKey{std::move(shardIDKey)},
           samplesPerShard{samplesPerShard},
+          rank{rank},
+          worldSize{worldSize},
+          seed{seed},
           sampleCounter{0} {
         loadNextShard();
     }
@@ -346,6 +563,9 @@ struct ZippedShardSampler final : Sampler {
     void loadNextShard() {
         // This item is expected to contain the shard path.
         auto item = base->sample();
+        static auto const loadName = traceName("loadNextShard");
+        TraceScope scope(loadName);
+        auto begin = std::chrono::steady_clock::now();
         currentShards.clear();
         currentShardID = std::get<int64_t>(item[shardIDKey]);
         for (auto const& shardPathKey : shardPathKeys) {
@@ -353,7 +573,17 @@ struct ZippedShardSampler final : Sampler {
             currentShards.push_back(loadShard(shardPath));
         }
         currentZippedShards = zipDatasets(currentShards);
-        currentSampler = currentZippedShards->permuteSample();
+        currentSampler = sampleLoadedShard(currentZippedShards, currentShardID,
+                                           rank, worldSize, seed);
+        loadLatency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - begin)
+                               .count());
+    }
+
+    Gauges gauges() override {
+        Gauges g;
+        addLatencyGauges(g, "shard_load", loadLatency);
+        return g;
     }
 
     Item sample() override {
@@ -369,12 +599,17 @@ struct ZippedShardSampler final : Sampler {
         item["shard_id"] = currentShardID;
         return item;
     }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle sampleZipShard(SamplerHandle s, StringList shardPathKeys,
-                             std::string shardIDKey, size_t samplesPerShard) {
-    return std::make_shared<ZippedShardSampler>(s, shardPathKeys, shardIDKey,
-                                                samplesPerShard);
+                             std::string shardIDKey, size_t samplesPerShard,
+                             size_t rank, size_t worldSize, uint64_t seed) {
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<ZippedShardSampler>(
+                          s, shardPathKeys, shardIDKey, samplesPerShard, rank,
+                          worldSize, seed),
+                      "sampleZipShard", std::move(inputs));
 }
 
 struct MappedSampler final : Sampler {
@@ -383,10 +618,16 @@ struct MappedSampler final : Sampler {
     MappedSampler(SamplerHandle base, ItemTransformHandle func)
         : base{base}, func{func} {}
     Item sample() override { return (*func)(base->sample()); }
+    FlatItem sampleFlat() override { return func->apply(base->sampleFlat()); }
+    bool hasFlatPath() const override { return base->hasFlatPath(); }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle mapSampler(SamplerHandle s, ItemTransformHandle func) {
-    return std::make_shared<MappedSampler>(std::move(s), std::move(func));
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(
+        std::make_shared<MappedSampler>(std::move(s), std::move(func)), "map",
+        std::move(inputs));
 }
 
 struct FilteredSampler final : Sampler {
@@ -394,69 +635,444 @@ struct FilteredSampler final : Sampler {
     ItemPredicateHandle pred;
     FilteredSampler(SamplerHandle base, ItemPredicateHandle pred)
         : base{base}, pred{std::move(pred)} {}
-    Item sample() override {
-        auto item = (*base).sample();
-        while (not(*pred)(item)) {
-            item = (*base).sample();
+    // Rejected samples are dropped without being copied.
+    Item sample() override { return std::move(sampleShared()).take(); }
+    SharedItem sampleShared() override {
+        auto item = base->sampleShared();
+        while (not(*pred)(*item)) {
+            item = base->sampleShared();
         }
         return item;
     }
+    void cancel() override { base->cancel(); }
 };
 
-SamplerHandle filterSampler(SamplerHandle s, ItemPredicateHandle pred) {
-    return std::make_shared<FilteredSampler>(std::move(s), std::move(pred));
+SamplerHandle filterSampler(SamplerHandle s, ItemPredicateHandle pred,
+                            bool pushdown) {
+    if (pushdown) {
+        auto base = uninstrumented(s);
+        if (auto d = std::dynamic_pointer_cast<SampledDataset>(base)) {
+            return sampleDataset(d->base->where(std::move(pred)));
+        }
+        if (auto d = std::dynamic_pointer_cast<PermuteSampledDataset>(base)) {
+            return d->rebase(d->base->where(std::move(pred)));
+        }
+    }
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(
+        std::make_shared<FilteredSampler>(std::move(s), std::move(pred)),
+        "filter", std::move(inputs));
 }
 
-using Queue = boost::concurrent::sync_bounded_queue<Item>;
-inline static void push_queue_forever(std::stop_token st, SamplerHandle sampler,
-                                      Queue& queue) {
-    while (not st.stop_requested()) {
-        try {
-            queue.push(sampler->sample());
-        } catch (...) {
+// Errors of the workers are passed to the consumer in place of items.
+using QueueEntry = std::variant<Item, std::exception_ptr>;
+using Queue = boost::concurrent::sync_bounded_queue<QueueEntry>;
+
+// State shared by a QueuedSampler and its workers. Workers own a reference,
+// so a worker stuck in a long sample() can be detached at teardown and exit
+// later on its own.
+struct QueueState {
+    SamplerHandle base;
+    CpuSet cpus;
+    size_t maxRetries;
+    Queue q;
+    std::atomic<size_t> active;
+    std::atomic<size_t> pinFailures{0};
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> consecutiveErrors{0};
+    // Time producers are blocked on a full queue.
+    LatencyHistogram pushWait;
+    // Time the consumer is blocked on an empty queue.
+    std::atomic<uint64_t> pullWaitNs{0};
+    // Workers still running, signalled by exited.
+    size_t running;
+    std::mutex exitLock;
+    std::condition_variable exited;
+
+    QueueState(SamplerHandle base, CpuSet cpus, size_t maxRetries,
+               size_t queueSize, size_t nThreads)
+        : base{std::move(base)},
+          cpus{std::move(cpus)},
+          maxRetries{maxRetries},
+          q(queueSize),
+          active{nThreads},
+          running{nThreads} {}
+};
+
+// Sleep for an exponential backoff after the n-th consecutive error, or
+// until stop is requested.
+inline static void backoff(std::stop_token const& st, size_t n) {
+    auto delay = std::chrono::milliseconds(1 << std::min<size_t>(n, 10));
+    std::mutex m;
+    std::condition_variable_any cv;
+    std::unique_lock lock(m);
+    cv.wait_for(lock, st, delay, [] { return false; });
+}
+
+// Lazy values are loaded by the workers, so that the consumer receives ready
+// items. Put filters before queue() to skip loading dropped items.
+// Failed samples are retried up to maxRetries times in a row with backoff,
+// then the error is passed to the consumer.
+inline static void push_queue_once(std::stop_token const& st, QueueState& s) {
+    QueueEntry entry;
+    try {
+        entry = materialize(s.base->sample());
+        s.consecutiveErrors = 0;
+    } catch (...) {
+        s.errors += 1;
+        auto n = s.consecutiveErrors.fetch_add(1) + 1;
+        if (n <= s.maxRetries) {
+            backoff(st, n - 1);
+            return;
+        }
+        s.consecutiveErrors = 0;
+        entry = std::current_exception();
+    }
+    static auto const pushName = traceName("queue push");
+    TraceScope scope(pushName);
+    auto begin = std::chrono::steady_clock::now();
+    s.q.push(std::move(entry));
+    s.pushWait.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - begin)
+                          .count());
+}
+
+// Workers [0, active) produce, the others are parked on active.
+inline static void run_queue_worker(std::stop_token st,
+                                    std::shared_ptr<QueueState> s,
+                                    size_t index) {
+    setTraceThreadName("queue worker");
+    if (not pinCurrentThread(s->cpus)) s->pinFailures += 1;
+    try {
+        while (not st.stop_requested()) {
+            auto n = s->active.load();
+            if (index >= n) {
+                s->active.wait(n);
+                continue;
+            }
+            push_queue_once(st, *s);
         }
+    } catch (boost::sync_queue_is_closed const&) {
     }
+    std::lock_guard guard(s->exitLock);
+    s->running -= 1;
+    s->exited.notify_all();
 }
 
+// In the adaptive mode, a controller moves the number of active workers
+// within [minThreads, maxThreads] once per interval:
+//  - the consumer waited on an empty queue for more than growWait of the
+//    interval: one more worker,
+//  - the consumer waited for less than shrinkWait of the interval, and the
+//    queue stayed above shrinkFill for shrinkPatience intervals: one less
+//    worker.
+// Only pulls that find the queue empty count as waiting.
+// Teardown closes the queue, which unblocks the workers waiting on it, and
+// waits at most shutdownTimeout for the others before detaching them.
 struct QueuedSampler final : Sampler {
-    SamplerHandle base;
+    static constexpr auto interval = std::chrono::milliseconds(100);
+    static constexpr double growWait = 0.02;
+    static constexpr double shrinkWait = 0.001;
+    static constexpr double shrinkFill = 0.75;
+    static constexpr int shrinkPatience = 10;
+    static constexpr auto shutdownTimeout = std::chrono::seconds(2);
+
+    size_t minThreads;
+    size_t maxThreads;
+    std::shared_ptr<QueueState> state;
     std::vector<std::jthread> workers;
-    Queue q;
-    Item sample() override { return q.pull(); }
-    QueuedSampler(SamplerHandle base, size_t nThreads, size_t queueSize)
-        : base{std::move(base)}, q(queueSize) {
-        for (size_t i = 0; i < nThreads; ++i) {
-            workers.emplace_back([this](std::stop_token st) {
-                push_queue_forever(st, this->base, q);
-            });
+    std::jthread controller;
+
+    Item sample() override {
+        static auto const pullName = traceName("queue pull");
+        TraceScope scope(pullName);
+        auto begin = std::chrono::steady_clock::now();
+        bool blocked = state->q.empty();
+        QueueEntry entry;
+        try {
+            entry = state->q.pull();
+        } catch (boost::sync_queue_is_closed const&) {
+            throw std::runtime_error("Sampling from a cancelled queue.");
+        }
+        if (blocked) {
+            state->pullWaitNs.fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin)
+                    .count(),
+                std::memory_order_relaxed);
+        }
+        if (auto e = std::get_if<std::exception_ptr>(&entry)) {
+            std::rethrow_exception(*e);
         }
+        return std::get<Item>(std::move(entry));
     }
-    virtual ~QueuedSampler() {
+
+    QueuedSampler(SamplerHandle base, size_t minThreads, size_t maxThreads,
+                  size_t queueSize, CpuSet cpus, size_t maxRetries)
+        : minThreads{minThreads}, maxThreads{maxThreads} {
+        if (minThreads > maxThreads or maxThreads == 0) {
+            throw std::runtime_error("Invalid queue worker range.");
+        }
+        state = std::make_shared<QueueState>(std::move(base), std::move(cpus),
+                                             maxRetries, queueSize, maxThreads);
+        if (minThreads < maxThreads) {
+            // Start in the middle of the range.
+            state->active = (minThreads + maxThreads + 1) / 2;
+        }
+        for (size_t i = 0; i < maxThreads; ++i) {
+            workers.emplace_back(run_queue_worker, state, i);
+        }
+        if (minThreads < maxThreads) {
+            controller =
+                std::jthread([this](std::stop_token st) { control(st); });
+        }
+    }
+
+    void control(std::stop_token st) {
+        std::mutex m;
+        std::condition_variable_any cv;
+        std::unique_lock lock(m);
+        auto& s = *state;
+        int fullIntervals = 0;
+        uint64_t lastWait = s.pullWaitNs.load();
+        while (true) {
+            cv.wait_for(lock, st, interval, [] { return false; });
+            if (st.stop_requested()) return;
+            auto wait = s.pullWaitNs.load();
+            double waitFraction =
+                static_cast<double>(wait - lastWait) /
+                std::chrono::duration_cast<std::chrono::nanoseconds>(interval)
+                    .count();
+            lastWait = wait;
+            double fill = static_cast<double>(s.q.size()) / s.q.capacity();
+            auto n = s.active.load();
+            if (waitFraction > growWait) {
+                fullIntervals = 0;
+                if (n < maxThreads) {
+                    s.active = n + 1;
+                    s.active.notify_all();
+                }
+            } else if (waitFraction < shrinkWait and fill > shrinkFill) {
+                if (++fullIntervals >= shrinkPatience and n > minThreads) {
+                    fullIntervals = 0;
+                    s.active = n - 1;
+                }
+            } else {
+                fullIntervals = 0;
+            }
+        }
+    }
+
+    // Stop the workers and close the queue. Pending and later sample() calls
+    // throw. Upstream stages are cancelled too.
+    void cancel() override {
+        controller = {};
         for (auto& worker : workers) {
             worker.request_stop();
         }
-        while (!q.empty()) {
-            q.pull();
+        state->q.close();
+        // Wake the parked workers to see the stop request.
+        state->active = maxThreads;
+        state->active.notify_all();
+        state->base->cancel();
+    }
+
+    Gauges gauges() override {
+        auto& s = *state;
+        Gauges g;
+        g["queue_size"] = s.q.size();
+        g["queue_capacity"] = s.q.capacity();
+        g["workers"] = workers.size();
+        g["active_workers"] = s.active.load();
+        g["pin_failures"] = s.pinFailures.load();
+        g["errors"] = s.errors.load();
+        g["pull_wait_total_ms"] = s.pullWaitNs.load() / 1e6;
+        addLatencyGauges(g, "push_wait", s.pushWait);
+        return g;
+    }
+
+    virtual ~QueuedSampler() {
+        // Do not cancel the upstream stages, they may be shared.
+        controller = {};
+        for (auto& worker : workers) {
+            worker.request_stop();
         }
+        state->q.close();
+        state->active = maxThreads;
+        state->active.notify_all();
+        std::unique_lock lock(state->exitLock);
+        bool done = state->exited.wait_for(lock, shutdownTimeout, [&] {
+            return state->running == 0;
+        });
+        lock.unlock();
         for (auto& worker : workers) {
-            if (worker.joinable()) {
+            if (done) {
                 worker.join();
+            } else {
+                worker.detach();
             }
         }
-        q.close();
     }
 };
 
 SamplerHandle queueSampler(SamplerHandle sampler, size_t nThreads,
-                           size_t queueSize) {
-    return std::make_shared<QueuedSampler>(std::move(sampler), nThreads,
-                                           queueSize);
+                           size_t queueSize, CpuSet cpus, size_t maxRetries) {
+    auto inputs = std::vector{sampler->stageStats()};
+    return instrument(
+        std::make_shared<QueuedSampler>(std::move(sampler), nThreads, nThreads,
+                                        queueSize, std::move(cpus),
+                                        maxRetries),
+        "queue", std::move(inputs));
+}
+
+SamplerHandle queueAdaptiveSampler(SamplerHandle sampler, size_t minThreads,
+                                   size_t maxThreads, size_t queueSize,
+                                   CpuSet cpus, size_t maxRetries) {
+    auto inputs = std::vector{sampler->stageStats()};
+    return instrument(
+        std::make_shared<QueuedSampler>(std::move(sampler), minThreads,
+                                        maxThreads, queueSize, std::move(cpus),
+                                        maxRetries),
+        "queueAdaptive", std::move(inputs));
+}
+
+// State shared by an OrderedMappedSampler and its workers. Workers own a
+// reference, so a worker stuck in base->sample() can be detached at teardown,
+// as in QueuedSampler.
+struct OrderedMapState {
+    SamplerHandle base;
+    ItemTransformHandle func;
+    std::mutex pullLock;
+    uint64_t nextIn{0};
+    ReorderBuffer<QueueEntry> buffer;
+    // Workers still running, signalled by exited.
+    size_t running;
+    std::mutex exitLock;
+    std::condition_variable exited;
+
+    OrderedMapState(SamplerHandle base, ItemTransformHandle func,
+                    size_t nThreads, size_t window)
+        : base{std::move(base)},
+          func{std::move(func)},
+          buffer(window),
+          running{nThreads} {}
+
+    // Produce one result, returns false once closed.
+    bool produce() {
+        uint64_t seq;
+        QueueEntry entry;
+        {
+            std::lock_guard guard(pullLock);
+            seq = nextIn;
+            if (not buffer.acquire(seq)) return false;
+            nextIn += 1;
+            try {
+                entry = base->sample();
+            } catch (...) {
+                entry = std::current_exception();
+            }
+        }
+        if (auto item = std::get_if<Item>(&entry)) {
+            try {
+                entry = materialize((*func)(std::move(*item)));
+            } catch (...) {
+                entry = std::current_exception();
+            }
+        }
+        buffer.put(seq, std::move(entry));
+        return true;
+    }
+};
+
+inline static void run_ordered_worker(std::stop_token st,
+                                      std::shared_ptr<OrderedMapState> s) {
+    setTraceThreadName("ordered map worker");
+    while (not st.stop_requested() and s->produce()) {
+    }
+    std::lock_guard guard(s->exitLock);
+    s->running -= 1;
+    s->exited.notify_all();
+}
+
+// Samples are drawn from base in order by one worker at a time, and
+// transformed in parallel. Results are emitted in the order they were drawn,
+// with at most window samples in flight. Errors are emitted in place of their
+// sample.
+// Teardown closes the buffer, which unblocks the workers waiting on it, and
+// waits at most shutdownTimeout for the others before detaching them.
+struct OrderedMappedSampler final : Sampler {
+    static constexpr auto shutdownTimeout = QueuedSampler::shutdownTimeout;
+
+    std::shared_ptr<OrderedMapState> state;
+    std::vector<std::jthread> workers;
+
+    OrderedMappedSampler(SamplerHandle base, ItemTransformHandle func,
+                         size_t nThreads, size_t window) {
+        if (nThreads == 0 or window == 0) {
+            throw std::runtime_error("Invalid ordered map configuration.");
+        }
+        state = std::make_shared<OrderedMapState>(
+            std::move(base), std::move(func), nThreads, window);
+        for (size_t i = 0; i < nThreads; ++i) {
+            workers.emplace_back(run_ordered_worker, state);
+        }
+    }
+
+    Item sample() override {
+        auto entry = state->buffer.take();
+        if (not entry) {
+            throw std::runtime_error("Sampling from a cancelled ordered map.");
+        }
+        if (auto e = std::get_if<std::exception_ptr>(&*entry)) {
+            std::rethrow_exception(*e);
+        }
+        return std::get<Item>(std::move(*entry));
+    }
+
+    void cancel() override {
+        state->buffer.close();
+        state->base->cancel();
+    }
+
+    Gauges gauges() override {
+        Gauges g;
+        g["workers"] = workers.size();
+        return g;
+    }
+
+    virtual ~OrderedMappedSampler() {
+        // Do not cancel the upstream stages, they may be shared.
+        state->buffer.close();
+        for (auto& worker : workers) worker.request_stop();
+        std::unique_lock lock(state->exitLock);
+        bool done = state->exited.wait_for(lock, shutdownTimeout, [&] {
+            return state->running == 0;
+        });
+        lock.unlock();
+        for (auto& worker : workers) {
+            if (done) {
+                worker.join();
+            } else {
+                worker.detach();
+            }
+        }
+    }
+};
+
+SamplerHandle mapOrderedSampler(SamplerHandle s, ItemTransformHandle func,
+                                size_t nThreads, size_t window) {
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<OrderedMappedSampler>(
+                          std::move(s), std::move(func), nThreads, window),
+                      "mapOrdered", std::move(inputs));
 }
 
 struct BucketizedSampler final : BatchSampler {
-    using BucketGrid = std::vector<std::vector<Item>>;
+    // Items are kept with their sort value resolved once on arrival.
+    using Bucket = std::vector<std::pair<int64_t, Item>>;
+    using BucketGrid = std::vector<Bucket>;
     SamplerHandle base;
-    std::string sortKey;
+    ItemField sortKey;
     Partition p;
     tbb::enumerable_thread_specific<BucketGrid> buckets;
 
@@ -470,13 +1086,15 @@ struct BucketizedSampler final : BatchSampler {
             _buckets = BucketGrid(p.size());
         }
         while (true) {
-            auto it = base->sample();
-            auto len = std::get<int64_t>(it[sortKey]);
+            auto [len, it] = withSample(*base, [&](auto& item) {
+                auto n = std::get<int64_t>(field(item, sortKey));
+                return std::pair{n, asItem(std::move(item))};
+            });
             int bin_idx = -1;
             for (int i = 0; i < p.size(); ++i) {
                 auto [a, b, c] = p[i];
                 if (a <= len and len < b) {
-                    _buckets[i].push_back(std::move(it));
+                    _buckets[i].emplace_back(len, std::move(it));
                     bin_idx = i;
                     break;
                 }
@@ -486,24 +1104,30 @@ struct BucketizedSampler final : BatchSampler {
             }
             auto [a, b, c] = p[bin_idx];
             if (_buckets[bin_idx].size() == c) {
-                ItemList items = std::move(_buckets[bin_idx]);
+                Bucket bucket = std::move(_buckets[bin_idx]);
                 _buckets[bin_idx].clear();
                 // Sort the items in descending order.
-                std::sort(items.begin(), items.end(),
-                          [this](auto&& u, auto&& v) {
-                              auto u_val = std::get<int64_t>(u[sortKey]);
-                              auto v_val = std::get<int64_t>(v[sortKey]);
-                              return v_val < u_val;
+                std::sort(bucket.begin(), bucket.end(),
+                          [](auto const& u, auto const& v) {
+                              return v.first < u.first;
                           });
+                ItemList items;
+                items.reserve(bucket.size());
+                for (auto& [len, item] : bucket) {
+                    items.push_back(std::move(item));
+                }
                 return items;
             }
         }
     }
+    void cancel() override { base->cancel(); }
 };
 
 BatchSamplerHandle bucketSampler(SamplerHandle s, std::string_view sortKey,
                                  Partition p) {
-    return std::make_shared<BucketizedSampler>(s, sortKey, p);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<BucketizedSampler>(s, sortKey, p),
+                      "bucket", std::move(inputs));
 }
 
 struct FixedSizeBatchedSampler final : BatchSampler {
@@ -519,17 +1143,20 @@ struct FixedSizeBatchedSampler final : BatchSampler {
         }
         return items;
     }
+    void cancel() override { base->cancel(); }
 };
 
 BatchSamplerHandle sampleFixedBatch(SamplerHandle s, size_t batchSize) {
-    return std::make_shared<FixedSizeBatchedSampler>(s, batchSize);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<FixedSizeBatchedSampler>(s, batchSize),
+                      "batch", std::move(inputs));
 }
 
 template <typename T>
 std::vector<T> gather_values(ItemList const& items, std::string_view key) {
     std::vector<T> result;
     for (const Item& item : items) {
-        result.push_back(std::get<T>(item.at(key.data())));
+        result.push_back(std::get<T>(loaded(item.at(key.data()))));
     }
     return result;
 }
@@ -545,7 +1172,8 @@ Item stack_items(ItemList const& items) {
     if (N == 0) return {};
     Item const& first = *(items.begin());
     for (auto const& p : first) {
-        auto const& [k, v] = p;
+        auto const& k = p.first;
+        auto const& v = loaded(p.second);
         if (std::holds_alternative<int64_t>(v)) {
             std::vector<int64_t> vs = gather_values<int64_t>(items, k);
             result[k] = to_tensor<int64_t, torch::kInt64>(vs);
@@ -580,10 +1208,13 @@ struct StackedBatchSampler final : Sampler {
         auto items = base->sample();
         return stack_items(items);
     }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle stackBatch(BatchSamplerHandle s) {
-    return std::make_shared<StackedBatchSampler>(std::move(s));
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<StackedBatchSampler>(std::move(s)),
+                      "stack", std::move(inputs));
 }
 
 struct FlattenedBatchSampler final : Sampler {
@@ -600,10 +1231,13 @@ struct FlattenedBatchSampler final : Sampler {
         lst.pop_back();
         return it;
     }
+    void cancel() override { base->cancel(); }
 };
 
 SamplerHandle flattenBatch(BatchSamplerHandle s) {
-    return std::make_shared<FlattenedBatchSampler>(s);
+    auto inputs = std::vector{s->stageStats()};
+    return instrument(std::make_shared<FlattenedBatchSampler>(s), "flatten",
+                      std::move(inputs));
 }
 
 struct ZippedSamplerDataset final : Sampler {
@@ -612,19 +1246,44 @@ struct ZippedSamplerDataset final : Sampler {
     std::string keyKey{"key"};
     ZippedSamplerDataset(SamplerHandle s, DatasetHandle d, std::string keyKey)
         : s{std::move(s)}, d{std::move(d)}, keyKey{std::move(keyKey)} {}
-    Item sample() override {
-        Item it = s->sample();
-        std::string const& key = std::get<std::string>(it[keyKey]);
-        Item dit = (*d)[key];
-        it.merge(std::move(dit));
+    Item sample() override { return std::move(sampleShared()).take(); }
+    // Fields of the sample take precedence. The merge goes into whichever
+    // item is not shared, so at most one of them is copied, and none if the
+    // sample holds only the key of the dataset item.
+    SharedItem sampleShared() override {
+        SharedItem it = s->sampleShared();
+        auto key = std::get<std::string>(it->at(keyKey));
+        SharedItem dit = d->sharedItem(key);
+        if (it->size() == 1) {
+            auto k = dit->find(keyKey);
+            if (k != dit->end() and
+                std::get_if<std::string>(&k->second) != nullptr and
+                std::get<std::string>(k->second) == key) {
+                return dit;
+            }
+        }
+        if (dit.unique() and not it.unique()) {
+            auto& out = dit.mutate();
+            for (auto const& [k, v] : *it) out.insert_or_assign(k, v);
+            return dit;
+        }
+        auto& out = it.mutate();
+        if (dit.unique()) {
+            out.merge(std::move(dit).take());
+        } else {
+            for (auto const& [k, v] : *dit) out.emplace(k, v);
+        }
         return it;
     }
+    void cancel() override { s->cancel(); }
 };
 
 // The key of the item must be stored in item[key].
 SamplerHandle zipSamplerDataset(SamplerHandle s, DatasetHandle d,
                                 std::string keyKey) {
-    return std::make_shared<ZippedSamplerDataset>(s, d, keyKey);
+    auto inputs = std::vector{s->stageStats(), d->stageStats()};
+    return instrument(std::make_shared<ZippedSamplerDataset>(s, d, keyKey),
+                      "zipDataset", std::move(inputs));
 }
 
 struct RotaryCacheSampler : BatchSampler {
@@ -632,41 +1291,44 @@ struct RotaryCacheSampler : BatchSampler {
     std::string cacheSuffix;
     std::string classKey;
     std::string keyKey;
-    // NEED OPTIMIZATION for now we are using a single mutex.
+    // Only shared pointers are swapped under the lock, copying happens
+    // outside of it.
     std::mutex lock;
-    std::map<int64_t, Item> itemCache;
+    std::map<int64_t, SharedItem> itemCache;
     RotaryCacheSampler(SamplerHandle s, std::string cacheSuffix,
                        std::string classKey, std::string keyKey)
         : s(s), cacheSuffix(cacheSuffix), classKey(classKey), keyKey(keyKey) {}
 
     // HACK return an empty list if the cache missed.
+    // The sample is cached as drawn, it is only copied on a hit, to add the
+    // fields of the cached item.
     ItemList sample() override {
-        auto item = s->sample();
+        auto shared = s->sampleShared();
         bool hit = false;
-        int64_t clsID = std::get<int64_t>(item[classKey]);
+        int64_t clsID = std::get<int64_t>(shared->at(classKey));
+        SharedItem cachedItem = shared;
         {
             std::lock_guard<std::mutex> guard(lock);
-            if (itemCache.contains(clsID)) {
-                // TODO ask a language lawyer what happens if we return an
-                // initializer list `return {item}`
-                auto cachedItem = std::move(itemCache[clsID]);
-                std::string_view cachedKey =
-                    std::get<std::string>(cachedItem[keyKey]);
-                std::string_view itemKey = std::get<std::string>(item[keyKey]);
-                itemCache[clsID] = item;
-                if (cachedKey != itemKey) {
-                    // Update item with stuff in cache:
-                    for (auto&& kv : cachedItem) {
-                        auto&& [k, v] = kv;
-                        item[k + cacheSuffix] = v;
-                    }
-                    hit = true;
-                }
-            } else {
-                itemCache[clsID] = item;
+            // Put the new item in the cache and take the old one out.
+            auto [iter, inserted] = itemCache.try_emplace(clsID, cachedItem);
+            if (not inserted) {
+                std::swap(iter->second, cachedItem);
+                hit = true;
             }
         }
         if (hit) {
+            std::string_view cachedKey =
+                std::get<std::string>(cachedItem->at(keyKey));
+            std::string_view itemKey =
+                std::get<std::string>(shared->at(keyKey));
+            hit = cachedKey != itemKey;
+        }
+        if (hit) {
+            Item item = std::move(shared).take();
+            // Update item with stuff in cache:
+            for (auto const& [k, v] : *cachedItem) {
+                item[k + cacheSuffix] = v;
+            }
             ItemList _tmp;
             _tmp.push_back(std::move(item));
             return _tmp;
@@ -674,6 +1336,7 @@ struct RotaryCacheSampler : BatchSampler {
             return {};
         }
     }
+    void cancel() override { s->cancel(); }
 };
 
 // For each item, read the Tensor stored in bufferKey, store it classwise.
@@ -681,8 +1344,10 @@ struct RotaryCacheSampler : BatchSampler {
 // Thus for this to work well, please use permutation based random sampler.
 SamplerHandle rotaryCacheSampler(SamplerHandle s, std::string cacheSuffix,
                                  std::string classKey, std::string keyKey) {
-    auto sampler =
-        std::make_shared<RotaryCacheSampler>(s, cacheSuffix, classKey, keyKey);
+    auto inputs = std::vector{s->stageStats()};
+    BatchSamplerHandle sampler = instrument(
+        std::make_shared<RotaryCacheSampler>(s, cacheSuffix, classKey, keyKey),
+        "rotaryCache", std::move(inputs));
     // HACK a trick with BatchSampler
     return sampler->flatten();
 }
@@ -3,21 +3,33 @@
 #include <stdexcept>
 #include <string_view>
 
+#include "affinity.h"
+#include "profiler.h"
 #include "tensor_utils.h"
 #include "types.h"
 
 namespace data {
 
 SamplerHandle mapSampler(SamplerHandle, ItemTransformHandle);
-SamplerHandle filterSampler(SamplerHandle, ItemPredicateHandle);
+SamplerHandle mapOrderedSampler(SamplerHandle s, ItemTransformHandle func,
+                                size_t nThreads, size_t window);
+SamplerHandle filterSampler(SamplerHandle, ItemPredicateHandle,
+                            bool pushdown);
 
 SamplerHandle sampleDataset(DatasetHandle d);
 SamplerHandle permuteSampleDataset(DatasetHandle d);
+SamplerHandle distributedPermuteSampleDataset(DatasetHandle d, size_t rank,
+                                              size_t worldSize, uint64_t seed,
+                                              std::string weightKey);
 
 SamplerHandle sampleSamplers(SamplerList samplers, StringList samplerIDs,
                              DoubleList weights);
 
-SamplerHandle queueSampler(SamplerHandle s, size_t nThreads, size_t queueSize);
+SamplerHandle queueSampler(SamplerHandle s, size_t nThreads, size_t queueSize,
+                           CpuSet cpus = {}, size_t maxRetries = 64);
+SamplerHandle queueAdaptiveSampler(SamplerHandle s, size_t minThreads,
+                                   size_t maxThreads, size_t queueSize,
+                                   CpuSet cpus = {}, size_t maxRetries = 64);
 
 SamplerHandle segmentSampler(SamplerHandle s, std::string_view bufferKey,
                              size_t segmentSize, int64_t dim);
@@ -33,9 +45,13 @@ SamplerHandle zipSamplerDataset(SamplerHandle s, DatasetHandle d,
                                 std::string keyKey);
 
 SamplerHandle sampleShard(SamplerHandle s, std::string shardPathKey,
-                          std::string shardIDKey, size_t samplesPerShard);
+                          std::string shardIDKey, size_t samplesPerShard,
+                          size_t rank = 0, size_t worldSize = 1,
+                          uint64_t seed = 0);
 SamplerHandle sampleZipShard(SamplerHandle s, StringList shardPathKeys,
-                             std::string shardIDKey, size_t samplesPerShard);
+                             std::string shardIDKey, size_t samplesPerShard,
+                             size_t rank = 0, size_t worldSize = 1,
+                             uint64_t seed = 0);
 
 BatchSamplerHandle sampleFixedBatch(SamplerHandle s, size_t batchSize);
 BatchSamplerHandle bucketSampler(SamplerHandle s, std::string_view sortKey,
@@ -46,20 +62,59 @@ SamplerHandle rotaryCacheSampler(SamplerHandle s, std::string cacheSuffix,
 
 struct Sampler : public std::enable_shared_from_this<Sampler> {
     virtual Item sample() = 0;
+    // Sample a FlatItem. Defaults to converting sample(), stages that access
+    // fields by ID pull from their base with this.
+    virtual FlatItem sampleFlat();
+    // Whether sampleFlat() builds FlatItems natively. Otherwise reading a
+    // field by name from sample() is cheaper than interning every field.
+    virtual bool hasFlatPath() const { return false; }
+    // Sample a SharedItem. Samplers over in-memory datasets hand out the
+    // items of the dataset without copying them, a stage copies an item only
+    // when it changes it (see SharedItem::mutate). Defaults to wrapping
+    // sample().
+    virtual SharedItem sampleShared();
 
     // Apply a transform to all the samples.
     // The transform is lazy, only applied when sample() is called.
     SamplerHandle map(ItemTransformHandle func) {
         return mapSampler(shared_from_this(), func);
     }
+    // Apply a transform with nThreads workers. Unlike queue().map(), the
+    // results keep the order of this sampler, which makes runs reproducible.
+    // At most window samples are in flight. Drawing from this sampler is
+    // serialized, only the transform runs in parallel.
+    SamplerHandle mapOrdered(ItemTransformHandle func, size_t nThreads,
+                             size_t window) {
+        return mapOrderedSampler(shared_from_this(), func, nThreads, window);
+    }
     // Drop samples that do not pass the test.
-    SamplerHandle filter(ItemPredicateHandle pred) {
-        return filterSampler(shared_from_this(), pred);
+    // With pushdown, a sampler drawing from a dataset is replaced by one
+    // drawing from the pre-filtered dataset (see Dataset::where), so every
+    // draw passes. The predicate is then evaluated once per item when the
+    // sampler is built, loading the items it can not answer from metadata,
+    // and throws if no item passes. Otherwise samples are drawn until one
+    // passes.
+    SamplerHandle filter(ItemPredicateHandle pred, bool pushdown = false) {
+        return filterSampler(shared_from_this(), pred, pushdown);
     }
     // Create n_threads workers that samples from this sampler and store the
     // samples into a shared queue.
-    SamplerHandle queue(size_t nThreads, size_t queueSize) {
-        return queueSampler(shared_from_this(), nThreads, queueSize);
+    // Workers are pinned to cpus if not empty. Pass currentAffinity() from a
+    // consumer pinned to a NUMA node to allocate the samples on its node.
+    // Errors are retried up to maxRetries times in a row with exponential
+    // backoff, then thrown from sample().
+    SamplerHandle queue(size_t nThreads, size_t queueSize, CpuSet cpus = {},
+                        size_t maxRetries = 64) {
+        return queueSampler(shared_from_this(), nThreads, queueSize,
+                            std::move(cpus), maxRetries);
+    }
+    // Like queue(), but the number of active workers follows the demand of
+    // the consumer, within [minThreads, maxThreads]. Idle workers are parked.
+    SamplerHandle queueAdaptive(size_t minThreads, size_t maxThreads,
+                                size_t queueSize, CpuSet cpus = {},
+                                size_t maxRetries = 64) {
+        return queueAdaptiveSampler(shared_from_this(), minThreads, maxThreads,
+                                    queueSize, std::move(cpus), maxRetries);
     }
     BatchSamplerHandle batch(size_t batchSize) {
         return sampleFixedBatch(shared_from_this(), batchSize);
@@ -87,17 +142,24 @@ struct Sampler : public std::enable_shared_from_this<Sampler> {
         return bucketSampler(shared_from_this(), sortKey, p);
     }
 
+    // Load shards from the paths sampled by this sampler. With worldSize > 1,
+    // the items of each shard are split between the ranks of a distributed
+    // job, as in Dataset::distributedPermuteSample(). To split the shards
+    // instead, draw the paths with distributedPermuteSample().
     SamplerHandle sampleShard(std::string shardPathKey, std::string shardIDKey,
-                              size_t samplesPerShard) {
+                              size_t samplesPerShard, size_t rank = 0,
+                              size_t worldSize = 1, uint64_t seed = 0) {
         return data::sampleShard(shared_from_this(), shardPathKey, shardIDKey,
-                                 samplesPerShard);
+                                 samplesPerShard, rank, worldSize, seed);
     }
 
     SamplerHandle sampleZipShard(StringList shardPathKeys,
-                                 std::string shardIDKey,
-                                 size_t samplesPerShard) {
+                                 std::string shardIDKey, size_t samplesPerShard,
+                                 size_t rank = 0, size_t worldSize = 1,
+                                 uint64_t seed = 0) {
         return data::sampleZipShard(shared_from_this(), shardPathKeys,
-                                    shardIDKey, samplesPerShard);
+                                    shardIDKey, samplesPerShard, rank,
+                                    worldSize, seed);
     }
 
     SamplerHandle rotaryCache(std::string cacheSuffix, std::string classKey,
@@ -106,12 +168,30 @@ struct Sampler : public std::enable_shared_from_this<Sampler> {
                                         classKey, keyKey);
     }
 
+    // Instrumentation, see profiler.h. stats() reports this stage and its
+    // inputs if it was built while profiling was enabled, otherwise only the
+    // gauges of this stage.
+    virtual StageStatsHandle stageStats() { return nullptr; }
+    virtual Gauges gauges() { return {}; }
+    StatsReport stats() {
+        if (auto st = stageStats()) return st->report();
+        return StatsReport{.values = gauges()};
+    }
+
+    // Cooperative cancellation of a pipeline: queue() stages stop their
+    // workers and fail pending and later sample() calls, other stages forward
+    // to their inputs.
+    virtual void cancel() {}
+
     virtual ~Sampler() = default;
 
    protected:
     Sampler() = default;
 };
 
+// Collate a list of items into a single item, see BatchSampler::stack().
+Item stack_items(ItemList const& items);
+
 SamplerHandle stackBatch(BatchSamplerHandle s);
 SamplerHandle flattenBatch(BatchSamplerHandle s);
 
@@ -122,6 +202,18 @@ struct BatchSampler : public std::enable_shared_from_this<BatchSampler> {
     SamplerHandle stack() { return stackBatch(shared_from_this()); }
     // Converts back to a sampler.
     SamplerHandle flatten() { return flattenBatch(shared_from_this()); }
+
+    // Instrumentation, see Sampler::stats().
+    virtual StageStatsHandle stageStats() { return nullptr; }
+    virtual Gauges gauges() { return {}; }
+    StatsReport stats() {
+        if (auto st = stageStats()) return st->report();
+        return StatsReport{.values = gauges()};
+    }
+
+    // See Sampler::cancel().
+    virtual void cancel() {}
+
     virtual ~BatchSampler() = default;
 
    protected:
@@ -0,0 +1,391 @@
+#include "shm.h"
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <torch/torch.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <thread>
+
+#include "profiler.h"
+#include "sampler.h"
+
+namespace data {
+
+namespace {
+constexpr uint64_t kMagic = 0x7464787852494e47;  // "tdxxRING"
+constexpr size_t kAlign = 64;
+
+constexpr size_t alignUp(size_t n) {
+    return (n + kAlign - 1) / kAlign * kAlign;
+}
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+struct RingHeader {
+    std::atomic<uint64_t> magic;
+    uint64_t nSlots;
+    uint64_t slotBytes;
+    std::atomic<uint32_t> closed;
+    // Slots are taken in turn. A producer must publish every slot it claims,
+    // since the consumer holding the same ticket waits for it.
+    std::atomic<uint64_t> writeSeq;
+    std::atomic<uint64_t> readSeq;
+};
+
+struct SlotHeader {
+    sem_t empty;
+    sem_t full;
+    // 0 for a skipped slot, an encoded item holds at least its field count.
+    uint64_t bytes;
+};
+
+size_t slotStride(size_t slotBytes) {
+    return alignUp(sizeof(SlotHeader)) + alignUp(slotBytes);
+}
+
+size_t totalBytes(size_t nSlots, size_t slotBytes) {
+    return alignUp(sizeof(RingHeader)) + nSlots * slotStride(slotBytes);
+}
+
+[[noreturn]] void throwErrno(std::string const& what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Item layout in a slot:
+//   u32 nFields, then per field:
+//   u32 nameLength, name, u8 kind, payload
+//   bool, int, float: 8 bytes; string: u64 length, bytes;
+//   Tensor: i8 dtype, u32 ndim, i64 sizes[ndim], data aligned to kAlign.
+enum Kind : uint8_t { kBool, kInt, kFloat, kString, kTensor };
+
+struct Writer {
+    char* base;
+    size_t capacity;
+    size_t pos{0};
+
+    char* reserve(size_t n, size_t align = 1) {
+        pos = (pos + align - 1) / align * align;
+        if (pos + n > capacity) {
+            throw std::runtime_error(
+                "Item does not fit in a shared memory slot of " +
+                std::to_string(capacity) + " bytes.");
+        }
+        auto p = base + pos;
+        pos += n;
+        return p;
+    }
+    template <typename T> void put(T const& v) {
+        std::memcpy(reserve(sizeof(T)), &v, sizeof(T));
+    }
+    void putBytes(void const* p, size_t n) {
+        if (n > 0) std::memcpy(reserve(n), p, n);
+    }
+};
+
+struct Reader {
+    char const* base;
+    size_t pos{0};
+    template <typename T> T get() {
+        T v;
+        std::memcpy(&v, base + pos, sizeof(T));
+        pos += sizeof(T);
+        return v;
+    }
+    std::string getString(size_t n) {
+        std::string s(base + pos, n);
+        pos += n;
+        return s;
+    }
+    char const* align() {
+        pos = alignUp(pos);
+        return base + pos;
+    }
+};
+
+size_t encodeItem(Item const& item, char* dst, size_t capacity) {
+    Writer w{dst, capacity};
+    w.put(static_cast<uint32_t>(item.size()));
+    for (auto const& [name, value] : item) {
+        w.put(static_cast<uint32_t>(name.size()));
+        w.putBytes(name.data(), name.size());
+        auto const& v = loaded(value);
+        if (auto p = std::get_if<bool>(&v)) {
+            w.put(kBool);
+            w.put(static_cast<int64_t>(*p));
+        } else if (auto p = std::get_if<int64_t>(&v)) {
+            w.put(kInt);
+            w.put(*p);
+        } else if (auto p = std::get_if<double>(&v)) {
+            w.put(kFloat);
+            w.put(*p);
+        } else if (auto p = std::get_if<std::string>(&v)) {
+            w.put(kString);
+            w.put(static_cast<uint64_t>(p->size()));
+            w.putBytes(p->data(), p->size());
+        } else if (auto p = std::get_if<Tensor>(&v)) {
+            auto t = p->to(torch::kCPU).contiguous();
+            w.put(kTensor);
+            w.put(static_cast<int8_t>(t.scalar_type()));
+            w.put(static_cast<uint32_t>(t.dim()));
+            for (auto s : t.sizes()) w.put(static_cast<int64_t>(s));
+            auto n = t.nbytes();
+            auto data = w.reserve(n, kAlign);
+            if (n > 0) std::memcpy(data, t.data_ptr(), n);
+        } else {
+            throw std::runtime_error(
+                "Found unsupported value type in shared memory item.");
+        }
+    }
+    return w.pos;
+}
+}  // namespace
+
+// The mapping of a ring, kept alive by the ring and by every tensor popped
+// from it.
+struct ShmMapping {
+    std::string name;
+    bool owner{false};
+    void* addr{nullptr};
+    size_t length{0};
+
+    ~ShmMapping() {
+        if (addr != nullptr) munmap(addr, length);
+    }
+    RingHeader& header() const { return *static_cast<RingHeader*>(addr); }
+    SlotHeader& slot(size_t i) const {
+        auto p = static_cast<char*>(addr) + alignUp(sizeof(RingHeader)) +
+                 i * slotStride(header().slotBytes);
+        return *reinterpret_cast<SlotHeader*>(p);
+    }
+    char* payload(size_t i) const {
+        return reinterpret_cast<char*>(&slot(i)) + alignUp(sizeof(SlotHeader));
+    }
+};
+
+namespace {
+// Wait on a semaphore, waking up periodically to check for closing.
+void waitSlot(ShmMapping const& m, sem_t* sem) {
+    while (true) {
+        if (m.header().closed.load()) {
+            throw std::runtime_error("Shared memory ring is closed.");
+        }
+        timespec deadline{};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100'000'000;
+        if (deadline.tv_nsec >= 1'000'000'000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1'000'000'000;
+        }
+        if (sem_timedwait(sem, &deadline) == 0) return;
+        if (errno != ETIMEDOUT and errno != EINTR) throwErrno("sem_timedwait");
+    }
+}
+
+// Claim the next slot in turn and wait until it is free (or full).
+size_t acquireSlot(ShmMapping const& m, bool full) {
+    auto& header = m.header();
+    auto seq = (full ? header.readSeq : header.writeSeq).fetch_add(1);
+    auto i = seq % header.nSlots;
+    auto& s = m.slot(i);
+    waitSlot(m, full ? &s.full : &s.empty);
+    return i;
+}
+
+// Hands the slot back to the producers once all its tensors are released.
+struct SlotLease {
+    std::shared_ptr<ShmMapping> m;
+    size_t slot;
+    ~SlotLease() { sem_post(&m->slot(slot).empty); }
+};
+}  // namespace
+
+ShmRing::ShmRing(std::shared_ptr<ShmMapping> mapping) : m{std::move(mapping)} {}
+
+ShmRing::~ShmRing() {
+    if (m->owner) shm_unlink(m->name.c_str());
+}
+
+std::shared_ptr<ShmRing> ShmRing::create(std::string const& name,
+                                         size_t nSlots, size_t slotBytes) {
+    if (nSlots == 0 or slotBytes == 0) {
+        throw std::runtime_error("Shared memory ring must not be empty.");
+    }
+    auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) throwErrno("shm_open " + name);
+    auto mapping = std::make_shared<ShmMapping>();
+    mapping->name = name;
+    mapping->owner = true;
+    mapping->length = totalBytes(nSlots, slotBytes);
+    if (ftruncate(fd, static_cast<off_t>(mapping->length)) != 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        throwErrno("ftruncate " + name);
+    }
+    mapping->addr = mmap(nullptr, mapping->length, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping->addr == MAP_FAILED) {
+        mapping->addr = nullptr;
+        shm_unlink(name.c_str());
+        throwErrno("mmap " + name);
+    }
+    auto header = new (mapping->addr) RingHeader{};
+    header->nSlots = nSlots;
+    header->slotBytes = slotBytes;
+    header->closed = 0;
+    header->writeSeq = 0;
+    header->readSeq = 0;
+    for (size_t i = 0; i < nSlots; ++i) {
+        auto& s = mapping->slot(i);
+        sem_init(&s.empty, 1, 1);
+        sem_init(&s.full, 1, 0);
+        s.bytes = 0;
+    }
+    // Openers wait for the magic, published after the slots.
+    header->magic.store(kMagic, std::memory_order_release);
+    return std::shared_ptr<ShmRing>(new ShmRing(std::move(mapping)));
+}
+
+std::shared_ptr<ShmRing> ShmRing::open(std::string const& name) {
+    auto fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) throwErrno("shm_open " + name);
+    // The creator may still be sizing the segment.
+    struct stat st {};
+    for (int i = 0; i < 100; ++i) {
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throwErrno("fstat " + name);
+        }
+        if (static_cast<size_t>(st.st_size) >= sizeof(RingHeader)) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto mapping = std::make_shared<ShmMapping>();
+    mapping->name = name;
+    mapping->length = static_cast<size_t>(st.st_size);
+    mapping->addr = mmap(nullptr, mapping->length, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping->addr == MAP_FAILED or mapping->length < sizeof(RingHeader)) {
+        mapping->addr = nullptr;
+        throw std::runtime_error("Could not map shared memory ring: " + name);
+    }
+    auto& header = mapping->header();
+    for (int i = 0; header.magic.load(std::memory_order_acquire) != kMagic;
+         ++i) {
+        if (i == 100) {
+            throw std::runtime_error("Not a shared memory ring: " + name);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (totalBytes(header.nSlots, header.slotBytes) > mapping->length) {
+        throw std::runtime_error("Truncated shared memory ring: " + name);
+    }
+    return std::shared_ptr<ShmRing>(new ShmRing(std::move(mapping)));
+}
+
+void ShmRing::push(Item const& item) {
+    auto i = acquireSlot(*m, false);
+    auto& s = m->slot(i);
+    try {
+        s.bytes = encodeItem(item, m->payload(i), m->header().slotBytes);
+    } catch (...) {
+        s.bytes = 0;
+        sem_post(&s.full);
+        throw;
+    }
+    sem_post(&s.full);
+}
+
+Item ShmRing::pop() {
+    auto i = acquireSlot(*m, true);
+    while (m->slot(i).bytes == 0) {
+        sem_post(&m->slot(i).empty);
+        i = acquireSlot(*m, true);
+    }
+    auto lease = std::make_shared<SlotLease>(m, i);
+    Reader r{m->payload(i)};
+    Item item;
+    auto nFields = r.get<uint32_t>();
+    for (uint32_t f = 0; f < nFields; ++f) {
+        auto name = r.getString(r.get<uint32_t>());
+        auto kind = r.get<uint8_t>();
+        switch (kind) {
+            case kBool:
+                item[name] = r.get<int64_t>() != 0;
+                break;
+            case kInt:
+                item[name] = r.get<int64_t>();
+                break;
+            case kFloat:
+                item[name] = r.get<double>();
+                break;
+            case kString:
+                item[name] = r.getString(r.get<uint64_t>());
+                break;
+            case kTensor: {
+                auto dtype = static_cast<c10::ScalarType>(r.get<int8_t>());
+                std::vector<int64_t> sizes(r.get<uint32_t>());
+                for (auto& size : sizes) size = r.get<int64_t>();
+                auto data = const_cast<char*>(r.align());
+                auto t = torch::from_blob(
+                    data, sizes, [lease](void*) {},
+                    torch::TensorOptions().dtype(dtype));
+                r.pos += t.nbytes();
+                item[name] = t;
+                break;
+            }
+            default:
+                throw std::runtime_error("Corrupted shared memory item.");
+        }
+    }
+    return item;
+}
+
+size_t ShmRing::pump(SamplerHandle sampler, size_t count) {
+    size_t n = 0;
+    while ((count == 0 or n < count) and not closed()) {
+        auto item = materialize(sampler->sample());
+        try {
+            push(item);
+        } catch (std::runtime_error const&) {
+            if (closed()) break;
+            throw;
+        }
+        n += 1;
+    }
+    return n;
+}
+
+void ShmRing::close() { m->header().closed.store(1); }
+bool ShmRing::closed() const { return m->header().closed.load() != 0; }
+size_t ShmRing::slots() const { return m->header().nSlots; }
+size_t ShmRing::slotBytes() const { return m->header().slotBytes; }
+
+struct ShmRingSampler final : Sampler {
+    ShmRingHandle ring;
+    explicit ShmRingSampler(ShmRingHandle ring) : ring{std::move(ring)} {}
+    Item sample() override { return ring->pop(); }
+    void cancel() override { ring->close(); }
+    Gauges gauges() override {
+        Gauges g;
+        g["slots"] = ring->slots();
+        g["slot_bytes"] = ring->slotBytes();
+        return g;
+    }
+};
+
+SamplerHandle shmRingSampler(ShmRingHandle ring) {
+    return instrument(std::make_shared<ShmRingSampler>(std::move(ring)),
+                      "shmRing", {});
+}
+
+}  // namespace data
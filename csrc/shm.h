@@ -0,0 +1,63 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "types.h"
+
+/*
+A ring of item slots in POSIX shared memory, to pass collated batches between
+processes without pickling. Loader processes push items into free slots, the
+trainer pops them. Popped tensors are views of the slot, created with
+from_blob, and the slot is handed back to the producers when the last tensor
+of the item is released.
+
+Each slot has two process-shared semaphores, "empty" and "full", so producers
+and consumers in any number of processes block on slots instead of polling.
+Slots are claimed in turn. With a single producer, items are popped in the
+order pushed. With several producers, items are popped in the order their
+slots were claimed, and a slow push holds back the items claimed after it.
+*/
+
+namespace data {
+
+struct ShmMapping;
+
+class ShmRing {
+   public:
+    // Create a ring of nSlots slots of slotBytes each. The name is unlinked
+    // when the creator is destroyed, opened rings stay mapped.
+    static std::shared_ptr<ShmRing> create(std::string const& name,
+                                           size_t nSlots, size_t slotBytes);
+    static std::shared_ptr<ShmRing> open(std::string const& name);
+
+    // Copy an item into a free slot, blocking while the ring is full. Values
+    // must be bool, int, float, string or Tensor. If the item can not be
+    // encoded, e.g. it does not fit, the slot is published as skipped and
+    // the error is thrown.
+    void push(Item const& item);
+    // Take the next full slot, blocking while the ring is empty. Skipped
+    // slots are handed back to the producers.
+    Item pop();
+    // Push items from a sampler until count items are pushed, or forever if
+    // count is 0, or until the ring is closed. Returns the number pushed.
+    size_t pump(SamplerHandle sampler, size_t count);
+
+    // Wake all waiters in all processes, later push() and pop() throw.
+    void close();
+    [[nodiscard]] bool closed() const;
+    [[nodiscard]] size_t slots() const;
+    [[nodiscard]] size_t slotBytes() const;
+
+    ~ShmRing();
+
+   private:
+    explicit ShmRing(std::shared_ptr<ShmMapping> mapping);
+    std::shared_ptr<ShmMapping> m;
+};
+
+using ShmRingHandle = std::shared_ptr<ShmRing>;
+
+// A sampler popping items from a ring.
+SamplerHandle shmRingSampler(ShmRingHandle ring);
+
+}  // namespace data
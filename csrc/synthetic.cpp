@@ -0,0 +1,154 @@
+#include "synthetic.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+
+#include "audio.h"
+#include "dataset.h"
+#include "text/en_data.h"
+
+namespace data {
+
+namespace fs = std::filesystem;
+
+namespace {
+bool hasField(SyntheticSpec const& spec, std::string_view field) {
+    return std::find(spec.fields.begin(), spec.fields.end(), field) !=
+           spec.fields.end();
+}
+
+// PCM16 white noise at about -20 dBFS, shifted into int32 like sox does.
+Tensor noiseWave(std::mt19937_64& rng, int64_t n) {
+    std::normal_distribution<float> normal(0.0f, 3276.8f);
+    auto wave = torch::empty({n, 1}, torch::kInt32);
+    auto p = wave.data_ptr<int32_t>();
+    for (int64_t i = 0; i < n; ++i) {
+        auto v = std::clamp(normal(rng), -32768.0f, 32767.0f);
+        p[i] = static_cast<int32_t>(v) * 65536;
+    }
+    return wave;
+}
+
+// Phone IDs skip the padding and space symbols. Extra features are sparse, a
+// stress or punctuation mark on about one phone in eight.
+std::pair<Tensor, Tensor> randomPhones(std::mt19937_64& rng, int64_t n) {
+    std::uniform_int_distribution<int> phone(2, N_SYMBOLS - 1);
+    std::uniform_int_distribution<int> extra(0, N_EXTRA * 8 - 1);
+    auto phoneID = torch::empty({n}, torch::kInt32);
+    auto extras =
+        torch::zeros({n, static_cast<int64_t>(N_EXTRA)}, torch::kInt8);
+    auto pp = phoneID.data_ptr<int32_t>();
+    auto pe = extras.data_ptr<int8_t>();
+    for (int64_t i = 0; i < n; ++i) {
+        pp[i] = phone(rng);
+        auto e = extra(rng);
+        if (e < static_cast<int>(N_EXTRA)) pe[i * N_EXTRA + e] = 1;
+    }
+    return {phoneID, extras};
+}
+
+void checkSpec(SyntheticSpec const& spec) {
+    if (spec.minSamples > spec.maxSamples or
+        spec.minPhones > spec.maxPhones) {
+        throw std::runtime_error("Synthetic length range is empty.");
+    }
+    audioDtype(spec.waveDtype);
+}
+
+// Each item has its own seed, so items can be generated in any order.
+Item syntheticItem(SyntheticSpec const& spec, size_t shard, size_t index) {
+    std::seed_seq seq{static_cast<uint32_t>(spec.seed),
+                      static_cast<uint32_t>(spec.seed >> 32),
+                      static_cast<uint32_t>(shard),
+                      static_cast<uint32_t>(index)};
+    std::mt19937_64 rng(seq);
+    Item item;
+    if (hasField(spec, "wave")) {
+        std::uniform_int_distribution<int64_t> nSample(spec.minSamples,
+                                                       spec.maxSamples);
+        auto n = nSample(rng);
+        item["wave"] = noiseWave(rng, n);
+        item["nSample"] = n;
+        item["sr"] = spec.sampleRate;
+    }
+    if (hasField(spec, "phone")) {
+        std::uniform_int_distribution<int64_t> nPhone(spec.minPhones,
+                                                      spec.maxPhones);
+        auto n = nPhone(rng);
+        auto [phoneID, extra] = randomPhones(rng, n);
+        item["phone"] = phoneID;
+        item["extra"] = extra;
+        item["nPhone"] = n;
+    }
+    if (hasField(spec, "speaker")) {
+        std::uniform_int_distribution<int64_t> speaker(
+            0, std::max<int64_t>(spec.nSpeakers - 1, 0));
+        item["speaker"] = speaker(rng);
+    }
+    return item;
+}
+
+// Generate the items of a shard in parallel. With wavDir, waves are saved
+// there and replaced by their path.
+ItemDict generateShard(SyntheticSpec const& spec, size_t shard,
+                       fs::path const* wavDir) {
+    checkSpec(spec);
+    std::vector<Item> items(spec.itemsPerShard);
+    tbb::parallel_for(size_t{0}, items.size(), [&](size_t i) {
+        auto item = syntheticItem(spec, shard, i);
+        auto it = item.find("wave");
+        if (wavDir != nullptr and it != item.end()) {
+            auto path = (*wavDir / (std::to_string(i) + ".wav")).string();
+            wavSavePCM(std::get<Tensor>(it->second), path, spec.sampleRate,
+                       16);
+            item.erase(it);
+            item["path"] = path;
+        } else if (it != item.end() and not spec.waveFormat.empty()) {
+            item["audio"] = encodeAudio(std::get<Tensor>(it->second),
+                                        spec.sampleRate, spec.waveFormat, 16);
+            item.erase(it);
+        } else if (it != item.end()) {
+            it->second = pcm32AsDtype(std::get<Tensor>(it->second),
+                                      audioDtype(spec.waveDtype));
+        }
+        items[i] = std::move(item);
+    });
+    ItemDict result;
+    for (size_t i = 0; i < items.size(); ++i) {
+        result.emplace(std::to_string(shard) + "/" + std::to_string(i),
+                       std::move(items[i]));
+    }
+    return result;
+}
+}  // namespace
+
+ItemDict syntheticItems(SyntheticSpec const& spec, size_t shard) {
+    return generateShard(spec, shard, nullptr);
+}
+
+StringList writeSyntheticCorpus(std::string const& dir,
+                                SyntheticSpec const& spec, size_t nThreads) {
+    fs::create_directories(dir);
+    StringList paths(spec.nShards);
+    auto write = [&](size_t shard) {
+        auto name = "shard_" + std::to_string(shard);
+        auto wavDir = fs::path(dir) / name;
+        if (spec.wavFiles) fs::create_directories(wavDir);
+        auto items =
+            generateShard(spec, shard, spec.wavFiles ? &wavDir : nullptr);
+        paths[shard] = (fs::path(dir) / (name + ".pt")).string();
+        saveShard(items, paths[shard]);
+    };
+    tbb::task_arena arena(nThreads == 0 ? tbb::task_arena::automatic
+                                        : static_cast<int>(nThreads));
+    arena.execute([&] { tbb::parallel_for(size_t{0}, spec.nShards, write); });
+    return paths;
+}
+
+}  // namespace data
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "types.h"
+
+/*
+Synthetic corpora for load testing and benchmarks. Items mimic the fields of
+a TTS corpus, so that pipelines written for real data run unchanged:
+    wave:    IntTensor[nSample, 1], PCM16 noise in int32 as read by sox, or
+             in spec.waveDtype.
+    nSample: int, sr: float.
+    path:    string, a WAV file holding the wave, if wavFiles is set.
+    audio:   ByteTensor, the encoded wave, if waveFormat is set.
+    phone:   IntTensor[nPhone] of symbol IDs, as from encodeIPA.
+    extra:   CharTensor[nPhone, N_EXTRA], nPhone: int.
+    speaker: int.
+*/
+
+namespace data {
+
+struct SyntheticSpec {
+    size_t nShards{1};
+    size_t itemsPerShard{1000};
+    // Fields to generate, from "wave", "phone" and "speaker".
+    StringList fields{"wave", "phone", "speaker"};
+    // Lengths are uniform in [min, max].
+    int64_t minSamples{16000};
+    int64_t maxSamples{160000};
+    int64_t minPhones{10};
+    int64_t maxPhones{200};
+    int64_t nSpeakers{100};
+    // Wave dtype, see audioDtype(). "int16" halves the size of shards.
+    std::string waveDtype{"int32"};
+    // Store waves encoded in this sox format, e.g. "flac", as a ByteTensor
+    // in "audio" instead of "wave", see decodeAudioTransform.
+    std::string waveFormat{};
+    double sampleRate{16000};
+    // Write the waves as WAV files next to the shards, and store their path
+    // instead of the wave.
+    bool wavFiles{false};
+    uint64_t seed{0};
+};
+
+// Generate the items of one shard. Keys are "<shard>/<item>". The result
+// depends only on spec and shard, not on the thread running it.
+ItemDict syntheticItems(SyntheticSpec const& spec, size_t shard);
+
+// Write spec.nShards shards as "<dir>/shard_<i>.pt" in parallel, with nThreads
+// threads, 0 for all cores. Returns the shard paths.
+StringList writeSyntheticCorpus(std::string const& dir,
+                                SyntheticSpec const& spec, size_t nThreads);
+
+}  // namespace data
@@ -8,10 +8,13 @@
 #include "speak_lib.h"
 #include "text/en_data.h"
 #include "text/utils.h"
+#include "trace.h"
 
 namespace data {
 
 espeak_phonemizer::espeak_phonemizer() {
+    static auto const initName = traceName("espeak init");
+    TraceScope scope(initName);
     auto rate = espeak_Initialize(
         espeak_AUDIO_OUTPUT::AUDIO_OUTPUT_SYNCH_PLAYBACK, 0, nullptr, 0);
     auto ret = espeak_SetVoiceByName("en-us");
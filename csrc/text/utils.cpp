@@ -90,7 +90,7 @@ struct EncodeIPATransform final : ItemTransform {
           extraKey{extraKey},
           nPhoneKey{nPhoneKey} {}
     Item operator()(Item item) override {
-        std::string IPA = std::get<std::string>(item[IPAKey]);
+        std::string IPA = std::get<std::string>(resolve(item[IPAKey]));
         // HACK Special begin and end of sentences symbols.
         IPA = "<" + IPA + ">";
         // END HACK
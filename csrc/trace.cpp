@@ -0,0 +1,180 @@
+#include "trace.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace data {
+
+namespace detail {
+std::atomic<bool> tracing{false};
+}  // namespace detail
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct Event {
+    uint32_t name;
+    int64_t begin;
+    int64_t end;
+};
+
+// Written by its own thread only, the mutex is uncontended except while
+// dumping or restarting.
+struct ThreadBuffer {
+    std::mutex lock;
+    uint32_t tid{};
+    std::string threadName{};
+    std::vector<Event> events{};
+    size_t next{0};
+};
+
+struct TraceState {
+    std::mutex lock;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    size_t capacity{0};
+    uint32_t nextTid{1};
+    Clock::time_point origin{Clock::now()};
+
+    std::mutex namesLock;
+    std::map<std::string, uint32_t, std::less<>> ids;
+    std::deque<std::string> names;
+};
+
+TraceState& state() {
+    static TraceState s;
+    return s;
+}
+
+ThreadBuffer& localBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+        auto& s = state();
+        auto b = std::make_shared<ThreadBuffer>();
+        std::lock_guard guard(s.lock);
+        b->tid = s.nextTid++;
+        b->events.resize(s.capacity);
+        s.buffers.push_back(b);
+        return b;
+    }();
+    return *buffer;
+}
+
+void writeEscaped(std::ostream& os, std::string_view s) {
+    for (char c : s) {
+        if (c == '"' or c == '\\') {
+            os << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            os << ' ';
+        } else {
+            os << c;
+        }
+    }
+}
+}  // namespace
+
+int64_t detail::traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               Clock::now() - state().origin)
+        .count();
+}
+
+void detail::recordEvent(uint32_t name, int64_t beginNs, int64_t endNs) {
+    auto& b = localBuffer();
+    std::lock_guard guard(b.lock);
+    if (b.events.empty()) return;
+    b.events[b.next % b.events.size()] = Event{name, beginNs, endNs};
+    b.next += 1;
+}
+
+uint32_t traceName(std::string_view name) {
+    auto& s = state();
+    std::lock_guard guard(s.namesLock);
+    auto it = s.ids.find(name);
+    if (it != s.ids.end()) return it->second;
+    auto id = static_cast<uint32_t>(s.names.size());
+    s.names.emplace_back(name);
+    s.ids.emplace(s.names.back(), id);
+    return id;
+}
+
+void setTraceThreadName(std::string_view name) {
+    auto& b = localBuffer();
+    std::lock_guard guard(b.lock);
+    b.threadName = name;
+}
+
+void startTrace(size_t eventsPerThread) {
+    auto& s = state();
+    std::lock_guard guard(s.lock);
+    detail::tracing = false;
+    s.capacity = eventsPerThread;
+    // Drop the buffers of exited threads, reset the others.
+    std::erase_if(s.buffers, [](auto const& b) { return b.use_count() == 1; });
+    for (auto& b : s.buffers) {
+        std::lock_guard bufferGuard(b->lock);
+        b->events.assign(eventsPerThread, Event{});
+        b->next = 0;
+    }
+    detail::tracing = eventsPerThread > 0;
+}
+
+void stopTrace() { detail::tracing = false; }
+
+void dumpTrace(std::string const& path) {
+    std::ofstream os(path);
+    if (!os) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    auto& s = state();
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard guard(s.lock);
+        buffers = s.buffers;
+    }
+    std::vector<std::string> names;
+    {
+        std::lock_guard guard(s.namesLock);
+        names.assign(s.names.begin(), s.names.end());
+    }
+    auto pid = getpid();
+    bool first = true;
+    auto separator = [&] {
+        if (not first) os << ",\n";
+        first = false;
+    };
+    os << std::fixed << std::setprecision(3);
+    os << "{\"traceEvents\":[\n";
+    for (auto& b : buffers) {
+        std::lock_guard guard(b->lock);
+        if (not b->threadName.empty()) {
+            separator();
+            os << R"({"name":"thread_name","ph":"M","pid":)" << pid
+               << R"(,"tid":)" << b->tid << R"(,"args":{"name":")";
+            writeEscaped(os, b->threadName);
+            os << "\"}}";
+        }
+        auto n = b->events.size();
+        if (n == 0) continue;
+        auto count = std::min(b->next, n);
+        for (size_t i = b->next - count; i < b->next; ++i) {
+            auto const& e = b->events[i % n];
+            separator();
+            os << R"({"name":")";
+            writeEscaped(os, e.name < names.size() ? names[e.name] : "?");
+            os << R"(","cat":"loader","ph":"X","ts":)" << e.begin / 1e3
+               << R"(,"dur":)" << (e.end - e.begin) / 1e3 << R"(,"pid":)"
+               << pid << R"(,"tid":)" << b->tid << "}";
+        }
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+}  // namespace data
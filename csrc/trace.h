@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+A low-overhead timeline of loader activity. While tracing, each thread
+records complete events (begin, duration) into its own ring buffer, the
+oldest events are overwritten when it is full. dumpTrace writes all buffers
+as Chrome trace JSON, which can be opened in chrome://tracing or Perfetto.
+*/
+
+namespace data {
+
+// Start tracing, keeping the latest eventsPerThread events of each thread.
+// Clears the events recorded before.
+void startTrace(size_t eventsPerThread);
+void stopTrace();
+// Write the recorded events as Chrome trace JSON. Can be called while
+// tracing.
+void dumpTrace(std::string const& path);
+
+namespace detail {
+extern std::atomic<bool> tracing;
+void recordEvent(uint32_t name, int64_t beginNs, int64_t endNs);
+int64_t traceNow();
+}  // namespace detail
+
+inline bool tracingEnabled() {
+    return detail::tracing.load(std::memory_order_relaxed);
+}
+
+// Event names are interned, resolve them once and keep the ID.
+uint32_t traceName(std::string_view name);
+
+// Name the calling thread in the trace.
+void setTraceThreadName(std::string_view name);
+
+// Records an event spanning the lifetime of the scope, if tracing.
+struct TraceScope {
+    uint32_t name;
+    int64_t begin{-1};
+    explicit TraceScope(uint32_t name) : name{name} {
+        if (tracingEnabled()) begin = detail::traceNow();
+    }
+    TraceScope(TraceScope const&) = delete;
+    TraceScope& operator=(TraceScope const&) = delete;
+    ~TraceScope() {
+        if (begin >= 0) detail::recordEvent(name, begin, detail::traceNow());
+    }
+};
+
+}  // namespace data
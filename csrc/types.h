@@ -11,6 +11,7 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <string>
@@ -32,14 +33,74 @@ using BatchSamplerHandle = std::shared_ptr<BatchSampler>;
 // Data Types
 using Tensor = torch::Tensor;
 using IValue = torch::IValue;
+struct LazyValue;
+using LazyValueHandle = std::shared_ptr<LazyValue>;
 using ValueType = std::variant<bool, int64_t, double, std::string, Tensor,
-                               DatasetHandle, SamplerHandle>;
+                               DatasetHandle, SamplerHandle, LazyValueHandle>;
 using Item = std::map<std::string, ValueType>;
+
+// A deferred value, computed by a thunk on first access. Copies of an item
+// share the handle, so the thunk runs at most once. If the thunk throws, the
+// next access retries.
+struct LazyValue {
+    explicit LazyValue(std::function<ValueType()> thunk)
+        : thunk{std::move(thunk)} {}
+
+    ValueType const& get() {
+        std::call_once(once, [this] {
+            ValueType v = thunk();
+            while (auto p = std::get_if<LazyValueHandle>(&v)) {
+                ValueType inner = (*p)->get();
+                v = std::move(inner);
+            }
+            value = std::move(v);
+            thunk = nullptr;
+        });
+        return value;
+    }
+
+   private:
+    std::function<ValueType()> thunk;
+    std::once_flag once;
+    ValueType value;
+};
+
+inline LazyValueHandle lazyValue(std::function<ValueType()> thunk) {
+    return std::make_shared<LazyValue>(std::move(thunk));
+}
+
+// Look through a lazy value, loading it if needed.
+inline ValueType const& loaded(ValueType const& v) {
+    if (auto p = std::get_if<LazyValueHandle>(&v)) return (*p)->get();
+    return v;
+}
+
+// Replace a lazy value with its loaded value in place.
+inline ValueType& resolve(ValueType& v) {
+    if (auto p = std::get_if<LazyValueHandle>(&v)) {
+        ValueType value = (*p)->get();
+        v = std::move(value);
+    }
+    return v;
+}
+
+// Load all the lazy values in an item.
+inline Item materialize(Item item) {
+    for (auto& [k, v] : item) resolve(v);
+    return item;
+}
 using Partition = std::vector<std::tuple<int, int, int>>;
+// Compact item representation with interned field IDs, see item.h.
+struct FlatItem;
+// Refcounted, copy-on-write Item, see item.h.
+class SharedItem;
 
 // Functional Types
 struct ItemTransform : public std::enable_shared_from_this<ItemTransform> {
     virtual Item operator()(Item item) = 0;
+    // Transform a FlatItem. Defaults to a round trip through Item, native
+    // transforms override it to resolve fields by ID.
+    virtual FlatItem apply(FlatItem item);
 };
 struct ItemPredicate : public std::enable_shared_from_this<ItemPredicate> {
     virtual bool operator()(Item const& item) = 0;
@@ -51,6 +112,18 @@ using ItemTransformHandle = std::shared_ptr<ItemTransform>;
 using ItemPredicateHandle = std::shared_ptr<ItemPredicate>;
 using KeyPredicateHandle = std::shared_ptr<KeyPredicate>;
 
+// A predicate that only reads a single field. Datasets with a metadata index
+// can evaluate it without loading items, see Dataset::select.
+struct FieldPredicate : ItemPredicate {
+    std::string field;
+    explicit FieldPredicate(std::string field) : field{std::move(field)} {}
+    virtual bool test(ValueType const& value) = 0;
+    bool operator()(Item const& item) override {
+        auto it = item.find(field);
+        return it != item.end() and test(loaded(it->second));
+    }
+};
+
 // List Types
 using StringList = std::vector<std::string>;
 using DoubleList = std::vector<double>;
@@ -0,0 +1,223 @@
+#include "wav.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <torch/torch.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "pcm.h"
+
+namespace data {
+
+static_assert(std::endian::native == std::endian::little,
+              "WAV samples are read in place as little endian.");
+
+namespace {
+constexpr uint16_t kFormatPCM = 1;
+constexpr uint16_t kFormatFloat = 3;
+constexpr uint16_t kFormatExtensible = 0xFFFE;
+
+template <typename T> T load(uint8_t const* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+bool isTag(uint8_t const* p, char const* tag) {
+    return std::memcmp(p, tag, 4) == 0;
+}
+
+// Samples as int32, aligned to the top bits like sox_sample_t.
+int32_t topAligned(uint32_t v) { return static_cast<int32_t>(v); }
+
+int32_t floatToInt32(float x) {
+    double v = std::round(static_cast<double>(x) * 2147483648.0);
+    return static_cast<int32_t>(std::clamp(v, -2147483648.0, 2147483647.0));
+}
+
+// Convert count interleaved samples, each read by sample() from its bytes.
+template <typename Out, typename Sample>
+void convert(uint8_t const* src, size_t count, unsigned bytes, Out* dst,
+             Sample sample) {
+    for (size_t i = 0; i < count; ++i) dst[i] = sample(src + i * bytes);
+}
+
+template <typename Out, typename Cast>
+void convertPCM(uint8_t const* src, size_t count, unsigned bits, Out* dst,
+                Cast cast) {
+    switch (bits) {
+        case 8:
+            convert(src, count, 1, dst, [&](uint8_t const* p) {
+                return cast(topAligned(uint32_t(p[0] ^ 0x80) << 24));
+            });
+            break;
+        case 16:
+            convert(src, count, 2, dst, [&](uint8_t const* p) {
+                return cast(topAligned(uint32_t(load<uint16_t>(p)) << 16));
+            });
+            break;
+        case 24:
+            convert(src, count, 3, dst, [&](uint8_t const* p) {
+                return cast(topAligned(uint32_t(p[0]) << 8 |
+                                       uint32_t(p[1]) << 16 |
+                                       uint32_t(p[2]) << 24));
+            });
+            break;
+        default:
+            convert(src, count, 4, dst, [&](uint8_t const* p) {
+                return cast(load<int32_t>(p));
+            });
+    }
+}
+}  // namespace
+
+std::shared_ptr<WavFile> WavFile::open(std::string const& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 or st.st_size < 12) {
+        ::close(fd);
+        return nullptr;
+    }
+    auto file = std::shared_ptr<WavFile>(new WavFile());
+    file->size = static_cast<size_t>(st.st_size);
+    // Private and writable, so in-place ops on views copy the pages instead
+    // of faulting.
+    auto addr = mmap(nullptr, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    file->addr = addr;
+    madvise(addr, file->size, MADV_SEQUENTIAL);
+
+    auto p = static_cast<uint8_t const*>(addr);
+    if (not isTag(p, "RIFF") or not isTag(p + 8, "WAVE")) return nullptr;
+    uint16_t format = 0, blockAlign = 0;
+    bool hasFormat = false;
+    size_t dataOffset = 0, dataBytes = 0;
+    for (size_t pos = 12; pos + 8 <= file->size;) {
+        auto tag = p + pos;
+        size_t len = load<uint32_t>(p + pos + 4);
+        auto body = pos + 8;
+        if (isTag(tag, "fmt ") and len >= 16 and body + len <= file->size) {
+            format = load<uint16_t>(p + body);
+            file->channels = load<uint16_t>(p + body + 2);
+            file->rate = load<uint32_t>(p + body + 4);
+            blockAlign = load<uint16_t>(p + body + 12);
+            file->bits = load<uint16_t>(p + body + 14);
+            if (format == kFormatExtensible and len >= 26) {
+                // The sub-format GUID starts with the actual format tag.
+                format = load<uint16_t>(p + body + 24);
+            }
+            hasFormat = true;
+        } else if (isTag(tag, "data")) {
+            // Streamed files may have a bogus data size, read to the end.
+            dataOffset = body;
+            dataBytes = std::min(len, file->size - body);
+            break;
+        }
+        if (len > file->size - body) break;
+        pos = body + len + (len & 1);
+    }
+
+    file->isFloat = format == kFormatFloat;
+    bool supported =
+        hasFormat and dataOffset > 0 and file->channels > 0 and
+        file->rate > 0 and
+        ((format == kFormatPCM and (file->bits == 8 or file->bits == 16 or
+                                    file->bits == 24 or file->bits == 32)) or
+         (file->isFloat and file->bits == 32)) and
+        blockAlign == file->channels * file->bits / 8;
+    if (not supported) return nullptr;
+    file->data = p + dataOffset;
+    file->length = dataBytes / blockAlign;
+    return file;
+}
+
+Tensor WavFile::wave(size_t offset, size_t n, torch::ScalarType dtype) const {
+    if (dtype == torch::kFloat16 or dtype == torch::kBFloat16) {
+        return wave(offset, n, torch::kFloat32).to(dtype);
+    }
+    offset = std::min(offset, length);
+    n = std::min(n, length - offset);
+    auto bytes = bits / 8;
+    auto src = data + offset * channels * bytes;
+    auto count = n * channels;
+    std::vector<int64_t> shape{static_cast<int64_t>(n),
+                               static_cast<int64_t>(channels)};
+
+    if (dtype == torch::kInt16 and bits == 16 and not isFloat and
+        reinterpret_cast<uintptr_t>(src) % alignof(int16_t) == 0) {
+        auto self = shared_from_this();
+        return torch::from_blob(
+            const_cast<uint8_t*>(src), shape, [self](void*) {},
+            torch::TensorOptions().dtype(torch::kInt16));
+    }
+
+    auto wave = torch::empty(shape, dtype);
+    switch (dtype) {
+        case torch::kInt32: {
+            auto dst = wave.data_ptr<int32_t>();
+            if (isFloat) {
+                convert(src, count, 4, dst, [](uint8_t const* p) {
+                    return floatToInt32(load<float>(p));
+                });
+            } else {
+                convertPCM(src, count, bits, dst, [](int32_t v) { return v; });
+            }
+            break;
+        }
+        case torch::kInt16: {
+            auto dst = wave.data_ptr<int16_t>();
+            if (isFloat) {
+                convert(src, count, 4, dst, [](uint8_t const* p) {
+                    return pcm32To16(floatToInt32(load<float>(p)));
+                });
+            } else {
+                convertPCM(src, count, bits, dst, pcm32To16);
+            }
+            break;
+        }
+        case torch::kFloat32: {
+            auto dst = wave.data_ptr<float>();
+            auto aligned = [&](size_t a) {
+                return reinterpret_cast<uintptr_t>(src) % a == 0;
+            };
+            if (isFloat) {
+                if (count > 0) std::memcpy(dst, src, count * sizeof(float));
+            } else if (bits == 16 and aligned(alignof(int16_t))) {
+                pcm16ToFloat32(reinterpret_cast<int16_t const*>(src), dst,
+                               count);
+            } else if (bits == 24) {
+                pcm24ToFloat32(src, dst, count);
+            } else if (bits == 32 and aligned(alignof(int32_t))) {
+                pcm32ToFloat32(reinterpret_cast<int32_t const*>(src), dst,
+                               count, 0x1p-31f);
+            } else {
+                convertPCM(src, count, bits, dst, [](int32_t v) {
+                    return static_cast<float>(v) * 0x1p-31f;
+                });
+            }
+            break;
+        }
+        default:
+            throw std::runtime_error(
+                "WAV samples can be read as int16, int32, float16, bfloat16 "
+                "or float32 only.");
+    }
+    return wave;
+}
+
+WavFile::~WavFile() {
+    if (addr != nullptr) munmap(addr, size);
+}
+
+}  // namespace data
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "types.h"
+
+/*
+A native reader for RIFF/WAVE files, which make up most corpora. The file is
+mapped in memory and samples are converted straight from the mapping into the
+requested dtype, skipping the per-file setup of libsox and the int32
+intermediate. Supported encodings are PCM 8, 16, 24 and 32 bits and IEEE
+float 32, plain or WAVE_FORMAT_EXTENSIBLE. Other files are left to sox.
+*/
+
+namespace data {
+
+class WavFile : public std::enable_shared_from_this<WavFile> {
+   public:
+    // Map path and parse its header. Returns nullptr if the file is not a WAV
+    // file in a supported encoding, so callers can fall back to sox.
+    static std::shared_ptr<WavFile> open(std::string const& path);
+
+    double rate{};
+    unsigned channels{};
+    // Number of frames, a frame holds one sample per channel.
+    size_t length{};
+    unsigned bits{};
+    bool isFloat{};
+
+    // Decode n frames from offset, up to the end of the file, as a tensor
+    // [n, channels] of dtype:
+    //   Int:   sign-extended to the top of 32 bits, the same values as sox.
+    //   Short: PCM16 as stored, a view of the mapping when possible; other
+    //          encodings are rounded to 16 bits.
+    //   Float, Half, BFloat16: scaled into [-1, 1).
+    [[nodiscard]] Tensor wave(size_t offset, size_t n,
+                              torch::ScalarType dtype) const;
+
+    WavFile(WavFile const&) = delete;
+    WavFile& operator=(WavFile const&) = delete;
+    ~WavFile();
+
+   private:
+    WavFile() = default;
+    void* addr{nullptr};
+    size_t size{0};
+    uint8_t const* data{nullptr};
+};
+
+using WavFileHandle = std::shared_ptr<WavFile>;
+
+}  // namespace data